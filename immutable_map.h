@@ -24,652 +24,3606 @@ SOFTWARE.
 
 #pragma once
 
+#if !(__cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L))
+#error "immutable_map.h requires C++17"
+#endif
+
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <future>
+#include <iterator>
 #include <utility>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
 
-template <class K, class T>
-class immutable_map
-{
-public:
-    typedef typename std::pair<K, T> pair;
-
-    immutable_map()
-      : root_(nullptr),
-        size_(0)
-    {}
+#if defined(__cpp_lib_three_way_comparison) && defined(__cpp_lib_concepts)
+#include <compare>
+#include <concepts>
+#define IMMUTABLE_MAP_THREE_WAY_COMPARISON 1
+#endif
 
-    immutable_map(const immutable_map& other)
-      : root_(other.root_),
-        size_(other.size_)
-    {}
+#if defined(__GNUC__) || defined(__clang__)
+#define IMMUTABLE_MAP_PREFETCH(ptr) __builtin_prefetch(ptr)
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define IMMUTABLE_MAP_PREFETCH(ptr) _mm_prefetch(reinterpret_cast<const char*>(ptr), _MM_HINT_T0)
+#else
+#define IMMUTABLE_MAP_PREFETCH(ptr) ((void)(ptr))
+#endif
 
-    immutable_map(immutable_map&& other)
+namespace immutable_map_detail
+{
+    // keeps a copy of an allocator, taking no space when the allocator is stateless
+    template <class A, bool = std::is_empty<A>::value && !std::is_final<A>::value>
+    class allocator_holder : private A
     {
-        std::swap(root_, other.root_);
-        std::swap(size_, other.size_);
-    }
+    public:
+        explicit allocator_holder(const A& alloc) : A(alloc) {}
+        const A& get_allocator() const { return *this; }
+    };
 
-    void operator = (const immutable_map& other)
+    template <class A>
+    class allocator_holder<A, false>
     {
-        root_ = other.root_;
-        size_ = other.size_;
-    }
+    public:
+        explicit allocator_holder(const A& alloc) : alloc_(alloc) {}
+        const A& get_allocator() const { return alloc_; }
 
-    void operator = (immutable_map&& other)
-    {
-        std::swap(root_, other.root_);
-        std::swap(size_, other.size_);
-    }
+    private:
+        A alloc_;
+    };
 
-    const T& at(const K& key) const
+    // keeps a copy of a key comparator, taking no space when it is stateless
+    template <class C, bool = std::is_empty<C>::value && !std::is_final<C>::value>
+    class compare_holder : private C
     {
-        path p;
-        auto match = find(p, key);
-        if (!match) throw std::out_of_range("missing key");
-        return p.get_node()->get_pair()->second;
-    }
+    public:
+        explicit compare_holder(const C& comp) : C(comp) {}
+        const C& key_comp() const { return *this; }
+        void set_key_comp(const C&) {}
+    };
 
-    bool empty() const
+    template <class C>
+    class compare_holder<C, false>
     {
-        return size_ == 0;
-    }
+    public:
+        explicit compare_holder(const C& comp) : comp_(comp) {}
+        const C& key_comp() const { return comp_; }
+        void set_key_comp(const C& comp) { comp_ = comp; }
 
-    size_t size() const
-    {
-        return size_;
-    }
+    private:
+        C comp_;
+    };
 
-    immutable_map insert(const pair& kvp) const
-    {
-        auto ptr = std::make_shared<pair>(kvp);
-        return insert(ptr);
-    }
+    template <class T, class = void>
+    struct is_equality_comparable : std::false_type {};
 
-    immutable_map insert(pair&& kvp) const
-    {
-        auto ptr = std::make_shared<pair>(std::move(kvp));
-        return insert_imp(ptr);
-    }
+    template <class T>
+    struct is_equality_comparable<T, decltype(void(std::declval<const T&>() == std::declval<const T&>()))> : std::true_type {};
 
-    immutable_map erase(const K& key) const
+    // fixed size blocks carved out of large slabs; every thread allocates from
+    // and frees to its own free list, and only touches the shared pool (under
+    // a lock) to take or hand back one chunk of at most blocks_per_slab blocks
+    // at a time, so no operation walks a list. A cache keeps its current list
+    // and at most one full chunk in reserve.
+    // slabs are kept for the lifetime of the process.
+    template <std::size_t Size>
+    class slab_pool
     {
-        path p;
-        auto match = find(p, key);
-        if (!match) return *this;
-        auto new_root = erase_imp(p);
-        return immutable_map(std::move(new_root), size_ - 1);
-    }
+    public:
+        static void* allocate()
+        {
+            if (cache_destroyed()) return take_shared();
+            auto& c = local_cache();
+            if (!c.free_) c.refill();
+            auto b = c.free_;
+            c.free_ = b->next_;
+            --c.count_;
+            return b;
+        }
 
-    bool contains(const K& key) const
-    {
-        path p;
-        auto match = find(p, key);
-        return match;
-    }
+        static void deallocate(void* ptr)
+        {
+            auto b = static_cast<block*>(ptr);
+            if (cache_destroyed())
+            {
+                b->next_ = nullptr;
+                push_chunk(b);
+                return;
+            }
+            auto& c = local_cache();
+            b->next_ = c.free_;
+            c.free_ = b;
+            if (++c.count_ == blocks_per_slab) c.retire_current();
+        }
 
-    template <class Function>
-    void foreach(Function f) const
-    {
-        if (root_) root_->foreach(f);
-    }
+    private:
+        // the head block of a chunk also links the chunks of the shared pool
+        struct block
+        {
+            block* next_;
+            block* next_chunk_;
+        };
 
-    template <class Function, class Pred1, class Pred2>
-    void foreach(Function f, Pred1 take_from, Pred2 take_to) const
-    {
-        if (root_) root_->foreach(f, take_from, take_to);
-    }
+        static_assert(Size >= sizeof(block), "slab_pool blocks must hold two pointers");
 
-    /*void validate() const
-    {
-        if (root_ && root_->is_red()) throw std::runtime_error("root is red");
-        if (root_) root_->validate();
-    }*/
+        static constexpr std::size_t blocks_per_slab = Size < 256 ? 65536 / Size : 256;
 
-private:
+        struct shared_list
+        {
+            std::mutex mutex_;
+            block* chunks_ = nullptr;
+        };
 
-    enum color_t { BLACK = 0, RED = 1 };
-    enum side_t { LEFT = 0, RIGHT = 1 };
-    
-    class node
-    {
-    public:
-        node(std::shared_ptr<const pair> kvp, std::shared_ptr<const node>&& left_child, std::shared_ptr<const node>&& right_child, color_t color)
-          : kvp_(kvp),
-            children_{ left_child, right_child },
-            color_(color)
-        {}
-        
-        node(const node& other)
-          : kvp_(other.kvp_),
-            children_{ other.children_[0], other.children_[1] },
-            color_(other.color_)
-        {}
-        
-        const K& get_key() const
+        // count_ never falls below the length of free_, so every list handed
+        // back holds at most blocks_per_slab blocks; a chunk taken from the
+        // shared pool counts as full even when a thread exit left it short.
+        // Maps that outlive the cache of their thread (thread_local or static
+        // ones destroyed later) move single blocks to and from the shared pool
+        struct cache
+        {
+            block* free_ = nullptr;
+            std::size_t count_ = 0;
+            block* reserve_ = nullptr;
+            ~cache()
+            {
+                push_chunk(reserve_);
+                push_chunk(free_);
+                reserve_ = nullptr;
+                free_ = nullptr;
+                count_ = 0;
+                cache_destroyed() = true;
+            }
+
+            void refill()
+            {
+                count_ = blocks_per_slab;
+                if (reserve_)
+                {
+                    std::swap(free_, reserve_);
+                    return;
+                }
+                free_ = pop_chunk();
+                if (!free_) free_ = new_slab();
+            }
+
+            // the current list is full: it becomes the reserve, and the
+            // previous reserve goes back to the shared pool
+            void retire_current()
+            {
+                push_chunk(reserve_);
+                reserve_ = free_;
+                free_ = nullptr;
+                count_ = 0;
+            }
+        };
+
+        static block* new_slab()
         {
-            return kvp_->first;
+            auto slab = static_cast<char*>(::operator new(Size * blocks_per_slab));
+            block* list = nullptr;
+            for (std::size_t i = blocks_per_slab; i-- > 0;)
+            {
+                auto b = reinterpret_cast<block*>(slab + i * Size);
+                b->next_ = list;
+                list = b;
+            }
+            return list;
         }
 
-        std::shared_ptr<const pair> get_pair() const
+        // takes the head of a shared chunk and hands the rest back
+        static block* take_shared()
         {
-            return kvp_;
+            auto chunk = pop_chunk();
+            if (!chunk) chunk = new_slab();
+            push_chunk(chunk->next_);
+            return chunk;
         }
 
-        std::shared_ptr<const node> get_child(int side) const
+        static void push_chunk(block* chunk)
         {
-            return children_[side];
+            if (!chunk) return;
+            auto& s = shared();
+            std::lock_guard<std::mutex> lock(s.mutex_);
+            chunk->next_chunk_ = s.chunks_;
+            s.chunks_ = chunk;
         }
 
-        color_t get_color() const { return color_; }
-        bool is_red() const { return color_ == RED; }
-        bool is_black() const { return color_ == BLACK; }
-        bool has_red_child() const
+        static block* pop_chunk()
         {
-            return (children_[0] && children_[0]->is_red()) || (children_[1] && children_[1]->is_red());
+            auto& s = shared();
+            std::lock_guard<std::mutex> lock(s.mutex_);
+            auto chunk = s.chunks_;
+            if (chunk) s.chunks_ = chunk->next_chunk_;
+            return chunk;
         }
 
-        void set_pair(std::shared_ptr<const pair> kvp)
+        static shared_list& shared()
         {
-            kvp_ = kvp;
+            static shared_list* s = new shared_list; // outlives every thread cache
+            return *s;
         }
 
-        void set_child(int side, std::shared_ptr<const node> child)
+        static cache& local_cache()
         {
-            children_[side] = std::move(child);
+            static thread_local cache c;
+            return c;
         }
 
-        void set_color(color_t color)
+        // kept apart from the cache, whose members are dead once it is destroyed
+        static bool& cache_destroyed()
         {
-            color_ = color;
+            static thread_local bool destroyed = false;
+            return destroyed;
         }
+    };
 
-        std::shared_ptr<node> clone() const
+    // epoch based reclamation of the versions replaced in atomic maps. A
+    // reader pins the current epoch with a store to a record of its own, and
+    // writers tag what they retire with the epoch it was unlinked in; the
+    // epoch only advances once every pinned reader has seen it, so anything
+    // retired two epochs ago is out of reach of all readers. Records are kept
+    // for the lifetime of the process and reused by later threads.
+    class epoch_domain
+    {
+    public:
+        static void pin()
         {
-            auto new_node = std::make_shared<immutable_map::node>(
-                kvp_,
-                get_child(LEFT),
-                get_child(RIGHT),
-                get_color()
-            );
-            return new_node;      
+            auto& l = local_state();
+            if (l.nesting_++ > 0) return;
+            auto epoch = shared().epoch_.load(std::memory_order_relaxed);
+            l.record_->epoch_.store(epoch * 2 + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
         }
 
-        template <class Function>
-        void foreach(Function f) const
+        static void unpin()
         {
-            if (get_child(LEFT)) get_child(LEFT)->foreach(f);
-            f(*kvp_);
-            if (get_child(RIGHT)) get_child(RIGHT)->foreach(f);
+            auto& l = local_state();
+            if (--l.nesting_ > 0) return;
+            l.record_->epoch_.store(0, std::memory_order_release);
         }
 
-        template <class Function, class Pred1, class Pred2>
-        void foreach(const Function& f, const Pred1& take_from, const Pred2& take_to) const
+        // the tag of an object that has just been unlinked
+        static std::uint64_t current()
         {
-            bool tf = take_from(kvp_->first);
-            bool tt = take_to(kvp_->first);
-            if (tf && get_child(LEFT)) get_child(LEFT)->foreach(f, take_from, take_to);
-            if (tf && tt) f(*kvp_);
-            if (tt && get_child(RIGHT)) get_child(RIGHT)->foreach(f, take_from, take_to);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return shared().epoch_.load(std::memory_order_relaxed);
         }
 
-        /*int validate() const
+        // advances the epoch if no reader is pinned in an older one, and
+        // returns the epoch reached
+        static std::uint64_t advance()
         {
-            int depth = 1, depth1, depth2;
-            if (is_red())
+            auto& s = shared();
+            auto epoch = s.epoch_.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            for (auto r = s.records_.load(std::memory_order_acquire); r; r = r->next_)
             {
-                depth = 0;
-                if (get_child(LEFT) && get_child(LEFT)->is_red())
-                    throw std::runtime_error("red node with red child");
-                if (get_child(RIGHT) && get_child(RIGHT)->is_red())
-                    throw std::runtime_error("red node with red child");
+                auto pinned = r->epoch_.load(std::memory_order_acquire);
+                if ((pinned & 1) && (pinned >> 1) != epoch) return epoch;
             }
-            if (get_child(LEFT)) depth1 = get_child(LEFT)->validate();
-            else depth1 = 0;
-            if (get_child(RIGHT)) depth2 = get_child(RIGHT)->validate();
-            else depth2 = 0;
-            if (depth1 != depth2) throw std::runtime_error("invalid black depth");
-            return depth1 + depth;
-        }*/
-
-        std::shared_ptr<const pair> kvp_;
-        std::shared_ptr<const node> children_[2];
-        color_t color_;
-    };
+            if (s.epoch_.compare_exchange_strong(epoch, epoch + 1, std::memory_order_release, std::memory_order_relaxed)) ++epoch;
+            return epoch;
+        }
 
-    class path
-    {
-    public:
-        path()
+        static bool is_reclaimable(std::uint64_t tag, std::uint64_t epoch)
         {
-            size_ = 0;
+            return epoch >= tag + 2;
         }
 
-        std::shared_ptr<const node> get_node()
+    private:
+        // a pinned record holds twice its epoch plus one, an idle one zero
+        struct alignas(64) record
         {
-            if (size_ > 0) return path_[size_ - 1];
-            return nullptr;
-        }
-        std::shared_ptr<const node> get_parent()
+            std::atomic<std::uint64_t> epoch_{0};
+            std::atomic<bool> in_use_{true};
+            record* next_ = nullptr;
+        };
+
+        struct shared_state
         {
-            if (size_ > 1) return path_[size_ - 2];
-            return nullptr;
+            std::atomic<std::uint64_t> epoch_{0};
+            std::atomic<record*> records_{nullptr};
+        };
+
+        struct local
+        {
+            record* record_ = claim();
+            unsigned int nesting_ = 0;
+
+            ~local() { record_->in_use_.store(false, std::memory_order_release); }
+        };
+
+        static record* claim()
+        {
+            auto& s = shared();
+            for (auto r = s.records_.load(std::memory_order_acquire); r; r = r->next_)
+            {
+                bool in_use = false;
+                if (r->in_use_.compare_exchange_strong(in_use, true, std::memory_order_acquire)) return r;
+            }
+            auto r = new record;
+            r->next_ = s.records_.load(std::memory_order_relaxed);
+            while (!s.records_.compare_exchange_weak(r->next_, r, std::memory_order_release, std::memory_order_relaxed)) {}
+            return r;
         }
-        std::shared_ptr<const node> get_grand_parent()
+
+        static shared_state& shared()
         {
-            if (size_ > 2) return path_[size_ - 3];
-            return nullptr;
+            static shared_state* s = new shared_state; // outlives every thread record
+            return *s;
         }
-        std::shared_ptr<const node> operator[](size_t n)
+
+        static local& local_state()
         {
-            return path_[n];
+            static thread_local local l;
+            return l;
         }
+    };
+}
 
-        void push(std::shared_ptr<const node> node) { path_[size_++] = node; }
-        void pop() { path_[--size_] = nullptr; }
-        bool empty() const { return size_ == 0; }
-        size_t size() const { return size_; }
+// allocator that serves single objects from a slab_pool sized for T, so the
+// nodes cloned along an update path do not reach malloc
+template <class T>
+class pool_allocator
+{
+public:
+    typedef T value_type;
 
-    private:
-        std::array<std::shared_ptr<const node>, sizeof(size_t) * 16> path_;
-        size_t size_;
-    };
+    pool_allocator() {}
 
-    std::shared_ptr<const node> root_;
-    size_t   size_;
+    template <class U>
+    pool_allocator(const pool_allocator<U>&) {}
 
-    immutable_map(std::shared_ptr<const node>&& root, size_t size)
+    T* allocate(std::size_t n)
     {
-        root_ = std::move(root);
-        size_ = size;
+        if (alignof(T) > alignof(std::max_align_t))
+            return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+        if (n != 1)
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        return static_cast<T*>(pool::allocate());
     }
 
-    immutable_map insert_imp(std::shared_ptr<const pair> kvp) const
+    void deallocate(T* ptr, std::size_t n)
     {
-        path p;
-        auto match = find(p, kvp->first);
-        if (match)
-        {
-            auto new_node = p.get_node()->clone();
-            new_node->set_pair(kvp);
-            p.pop();
-            return immutable_map(clone_path(p, new_node), size_);
-        }
-        auto new_root = insert_imp(kvp, p);
-        return immutable_map(std::move(new_root), size_ + 1);
+        if (alignof(T) > alignof(std::max_align_t))
+            ::operator delete(ptr, std::align_val_t(alignof(T)));
+        else if (n != 1)
+            ::operator delete(ptr);
+        else
+            pool::deallocate(ptr);
     }
 
-    std::shared_ptr<node> insert_imp(std::shared_ptr<const pair> kvp, path& p) const
+    template <class U>
+    bool operator == (const pool_allocator<U>&) const { return true; }
+
+    template <class U>
+    bool operator != (const pool_allocator<U>&) const { return false; }
+
+private:
+    static constexpr std::size_t align = alignof(std::max_align_t);
+    typedef immutable_map_detail::slab_pool<(sizeof(T) + align - 1) / align * align> pool;
+};
+
+// node reference counts are atomic, so versions of a map can be shared
+// between threads
+struct multi_thread_policy
+{
+    typedef std::atomic<unsigned int> counter_type;
+    static constexpr bool is_thread_safe = true;
+
+    static void increment(counter_type& refs)
     {
-        if (!root_)
-        {
-            return std::make_shared<immutable_map::node>(
-                std::move(kvp), nullptr, nullptr, BLACK
-            );
-        }
-        auto n = std::make_shared<immutable_map::node>(
-            std::move(kvp), nullptr, nullptr, RED
-        );
-        return insert_fix(p, n);
+        refs.fetch_add(1, std::memory_order_relaxed);
     }
 
-    bool find(path& p, const K& key) const
+    // returns true when the last reference has been dropped
+    static bool decrement(counter_type& refs, unsigned int count = 1)
     {
-        return find(root_, p, key);
+        return refs.fetch_sub(count, std::memory_order_acq_rel) == count;
     }
 
-    static bool find(std::shared_ptr<const node> root, path& p, const K& key)
+    // acquires the writes of the owners that dropped their references
+    static bool is_unique(const counter_type& refs)
     {
-        if (!root) return false;
-        auto node = root;
-        while (node)
-        {
-            p.push(node);
-            if (node->get_key() == key) return true;
-            if (node->get_key() > key) node = node->get_child(LEFT);
-            else node = node->get_child(RIGHT);
-        }
-        return false;
+        return refs.load(std::memory_order_acquire) == 1;
     }
+};
 
-    // precondition: path is not empty
-    std::shared_ptr<node> insert_fix(path& p, std::shared_ptr<node> n) const
+// plain reference counts for maps that never leave the thread that built them;
+// facilities that publish maps to other threads reject this policy at compile time
+struct single_thread_policy
+{
+    typedef unsigned int counter_type;
+    static constexpr bool is_thread_safe = false;
+
+    static void increment(counter_type& refs)
     {
-        if (p.empty())
-        {
-            n->set_color(BLACK);  
-            return n;
-        }
-        auto parent = p.get_node();
-        if (parent->is_black())
-        {
-            return clone_path(p, n);
-        }
-        else
-        {
-            auto grand_parent = p.get_parent();
-            auto parent_side = grand_parent->get_key() > parent->get_key() ? LEFT : RIGHT;
-            auto node_side = parent->get_key() > n->get_key() ? LEFT : RIGHT;
-            auto uncle = grand_parent->get_child(1 - parent_side);
-            if (uncle && uncle->is_red())
-            {
-                auto new_parent = parent->clone();
-                new_parent->set_color(BLACK);
-                new_parent->set_child(node_side, n);
-                auto new_uncle = uncle->clone();
-                new_uncle->set_color(BLACK);
-                auto new_grand_parent = grand_parent->clone();
-                new_grand_parent->set_color(RED);
-                new_grand_parent->set_child(parent_side, new_parent);
-                new_grand_parent->set_child(1 - parent_side, new_uncle);
-                p.pop(); p.pop();
-                return insert_fix(p, new_grand_parent);
-            }
-            else
-            {                
-                auto new_parent = parent->clone();
-                auto new_grand_parent = grand_parent->clone();
-                if (parent_side != node_side)
-                {
-                    new_parent->set_child(node_side, n->get_child(parent_side));
-                    new_grand_parent->set_child(parent_side, n->get_child(node_side));
-                    new_grand_parent->set_color(RED);
-                    n->set_child(parent_side, new_parent),
-                    n->set_child(node_side, new_grand_parent);
-                    n->set_color(BLACK);
-                    p.pop(); p.pop();
-                    return clone_path(p, n);
-                }
-                else
-                {
-                    new_grand_parent->set_child(parent_side, parent->get_child(1 - parent_side));
-                    new_grand_parent->set_color(RED);
-                    new_parent->set_child(1 - parent_side, new_grand_parent);
-                    new_parent->set_child(parent_side, n);
-                    new_parent->set_color(BLACK);
-                    p.pop(); p.pop();
-                    return clone_path(p, new_parent);
-                }
-            }
-        }
+        ++refs;
     }
 
-    std::shared_ptr<node> clone_path(path& p, std::shared_ptr<node> n) const
+    static bool decrement(counter_type& refs, unsigned int count = 1)
     {
-        while (auto parent = p.get_node())
-        {
-            auto new_parent = parent->clone();
-            if (new_parent->get_key() > n->get_key())
-                new_parent->set_child(LEFT, n);
-            else
-                new_parent->set_child(RIGHT, n);
-            n = new_parent;
-            p.pop();
+        return (refs -= count) == 0;
+    }
+
+    static bool is_unique(const counter_type& refs)
+    {
+        return refs == 1;
+    }
+};
+
+// aggregate policy that keeps nothing. An aggregate policy is a monoid over
+// the elements of a subtree, e.g. the sum of the values:
+//
+//     struct sum_of_values
+//     {
+//         typedef double value_type;
+//         static double identity() { return 0; }
+//         static double lift(const int& key, const double& value) { return value; }
+//         static double combine(double a, double b) { return a + b; }
+//     };
+//
+// combine must be associative and identity must be its neutral element
+struct no_aggregate
+{
+    typedef void value_type;
+};
+
+template <class Map>
+class atomic_immutable_map;
+
+template <class Map>
+class versioned_map;
+
+template <
+    class K,
+    class T,
+    class Compare = std::less<K>,
+    class Allocator = std::allocator<std::pair<K, T>>,
+    class ThreadingPolicy = multi_thread_policy,
+    bool OrderStatistics = false,
+    class Aggregate = no_aggregate
+>
+class immutable_map
+  : private immutable_map_detail::compare_holder<Compare>,
+    private immutable_map_detail::allocator_holder<Allocator>
+{
+public:
+    typedef typename std::pair<K, T> pair;
+    typedef Compare key_compare;
+    typedef Allocator allocator_type;
+    typedef ThreadingPolicy threading_policy;
+    static constexpr bool has_order_statistics = OrderStatistics;
+    typedef Aggregate aggregate_type;
+    typedef typename Aggregate::value_type aggregate_value;
+    static constexpr bool has_aggregate = !std::is_same<Aggregate, no_aggregate>::value;
+
+    // which ends of a key range belong to it
+    enum bounds_t
+    {
+        INCLUDE_NONE = 0,
+        INCLUDE_LOWER = 1,
+        INCLUDE_UPPER = 2,
+        INCLUDE_BOTH = INCLUDE_LOWER | INCLUDE_UPPER
+    };
+
+    // whether set operations may split their work across threads
+    enum execution_t
+    {
+        SEQUENTIAL = 0,
+        PARALLEL = 1
+    };
+
+    class const_iterator;
+    class transient;
+    typedef const_iterator iterator;
+    class const_reverse_iterator;
+    typedef const_reverse_iterator reverse_iterator;
+
+    immutable_map()
+      : immutable_map(Compare(), Allocator())
+    {}
+
+    explicit immutable_map(const Compare& comp, const Allocator& alloc = Allocator())
+      : compare_base(comp),
+        allocator_base(alloc),
+        root_(nullptr),
+        size_(0)
+    {}
+
+    explicit immutable_map(const Allocator& alloc)
+      : immutable_map(Compare(), alloc)
+    {}
+
+    immutable_map(const immutable_map& other)
+      : compare_base(other.key_comp()),
+        allocator_base(other.get_allocator()),
+        root_(other.root_),
+        size_(other.size_)
+    {}
+
+    immutable_map(immutable_map&& other)
+      : compare_base(other.key_comp()),
+        allocator_base(other.get_allocator()),
+        size_(0)
+    {
+        std::swap(root_, other.root_);
+        std::swap(size_, other.size_);
+    }
+
+    // the comparator goes with the tree it ordered, but the allocator is not
+    // propagated: nodes keep the allocator that created them, so a tree may
+    // safely mix nodes coming from different allocators
+    void operator = (const immutable_map& other)
+    {
+        compare_base::set_key_comp(other.key_comp());
+        root_ = other.root_;
+        size_ = other.size_;
+    }
+
+    void operator = (immutable_map&& other)
+    {
+        Compare comp = key_comp();
+        compare_base::set_key_comp(other.key_comp());
+        other.compare_base::set_key_comp(comp);
+        std::swap(root_, other.root_);
+        std::swap(size_, other.size_);
+    }
+
+    // builds a map from a range sorted by key in O(n), allocating one node per
+    // element; among equivalent keys the last one wins, as with repeated
+    // insert(), and a range that is not sorted throws std::invalid_argument
+    template <class ForwardIt>
+    static immutable_map from_sorted(ForwardIt first, ForwardIt last, const Compare& comp = Compare(), const Allocator& alloc = Allocator())
+    {
+        immutable_map map(comp, alloc);
+        size_t size = 0;
+        for (auto it = first; it != last; ++size) next_unique(it, last, comp);
+        if (size == 0) return map;
+        size_t red_depth = 0;
+        while ((size_t(2) << red_depth) <= size) ++red_depth;
+        map.root_ = map.build_sorted(first, last, size, 0, red_depth);
+        map.size_ = size;
+        return map;
+    }
+
+    key_compare key_comp() const
+    {
+        return compare_base::key_comp();
+    }
+
+    allocator_type get_allocator() const
+    {
+        return allocator_base::get_allocator();
+    }
+
+    const T& at(const K& key) const
+    {
+        return at_imp(key);
+    }
+
+    // with a transparent comparator, such as std::less<>, lookups accept any
+    // key type comparable with K without converting it to K first
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    const T& at(const Key& key) const
+    {
+        return at_imp(key);
+    }
+
+    // iterators stay valid as long as any map sharing the iterated nodes
+    const_iterator begin() const
+    {
+        const_iterator it(root_.get());
+        if (root_) it.push_leftmost(root_.get());
+        return it;
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(root_.get());
+    }
+
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    const_reverse_iterator rbegin() const
+    {
+        const_iterator it(root_.get());
+        it.push_rightmost(root_.get());
+        return const_reverse_iterator::at(std::move(it));
+    }
+
+    // as cheap as end(), since loops compare against it on every step
+    const_reverse_iterator rend() const
+    {
+        return const_reverse_iterator::at(const_iterator(root_.get()));
+    }
+
+    const_reverse_iterator crbegin() const { return rbegin(); }
+    const_reverse_iterator crend() const { return rend(); }
+
+    const_iterator find(const K& key) const
+    {
+        return find_imp(key);
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    const_iterator find(const Key& key) const
+    {
+        return find_imp(key);
+    }
+
+    // first element whose key is not less than key
+    const_iterator lower_bound(const K& key) const
+    {
+        return bound_imp(key, false);
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    const_iterator lower_bound(const Key& key) const
+    {
+        return bound_imp(key, false);
+    }
+
+    // first element whose key is greater than key
+    const_iterator upper_bound(const K& key) const
+    {
+        return bound_imp(key, true);
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    const_iterator upper_bound(const Key& key) const
+    {
+        return bound_imp(key, true);
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(const K& key) const
+    {
+        return equal_range_imp(key);
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    std::pair<const_iterator, const_iterator> equal_range(const Key& key) const
+    {
+        return equal_range_imp(key);
+    }
+
+    // the order statistics below need OrderStatistics = true, which stores
+    // the size of its subtree in every node
+
+    // element at position k in key order, or end() when k >= size()
+    const_iterator nth(size_t k) const
+    {
+        static_assert(OrderStatistics, "nth() requires OrderStatistics");
+        const_iterator it(root_.get());
+        if (k >= size_) return it;
+        auto node = root_.get();
+        while (true)
+        {
+            it.stack_[it.size_++] = node;
+            auto left = subtree_size(node->get_child(LEFT).get());
+            if (k == left) return it;
+            if (k < left)
+            {
+                node = node->get_child(LEFT).get();
+            }
+            else
+            {
+                k -= left + 1;
+                node = node->get_child(RIGHT).get();
+            }
+        }
+    }
+
+    // number of elements whose key is less than key
+    size_t rank(const K& key) const
+    {
+        return count_below(key, false);
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    size_t rank(const Key& key) const
+    {
+        return count_below(key, false);
+    }
+
+    // number of elements with keys between lo and hi
+    size_t count_range(const K& lo, const K& hi, bounds_t bounds = INCLUDE_LOWER) const
+    {
+        return count_range_imp(lo, hi, bounds);
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    size_t count_range(const Key& lo, const Key& hi, bounds_t bounds = INCLUDE_LOWER) const
+    {
+        return count_range_imp(lo, hi, bounds);
+    }
+
+    // the reductions below need an Aggregate policy, whose value is kept for
+    // the subtree of every node
+
+    // aggregate of the whole map, in O(1)
+    aggregate_value reduce() const
+    {
+        static_assert(has_aggregate, "reduce() requires an Aggregate policy");
+        return root_ ? root_->get_aggregate() : Aggregate::identity();
+    }
+
+    // aggregate of the elements with keys between lo and hi, in O(log n)
+    aggregate_value reduce_range(const K& lo, const K& hi, bounds_t bounds = INCLUDE_LOWER) const
+    {
+        return reduce_range_imp(root_.get(), lo, hi, bounds, true, true);
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    aggregate_value reduce_range(const Key& lo, const Key& hi, bounds_t bounds = INCLUDE_LOWER) const
+    {
+        return reduce_range_imp(root_.get(), lo, hi, bounds, true, true);
+    }
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    immutable_map insert(const pair& kvp) const&
+    {
+        return insert_imp(pair_storage(get_allocator(), kvp));
+    }
+
+    immutable_map insert(pair&& kvp) const&
+    {
+        return insert_imp(pair_storage(get_allocator(), std::move(kvp)));
+    }
+
+    // on a map about to be discarded, as in m = std::move(m).insert(kvp), the
+    // nodes that no other map shares are updated in place rather than copied
+    immutable_map insert(const pair& kvp) &&
+    {
+        insert_in_place(pair_storage(get_allocator(), kvp));
+        return std::move(*this);
+    }
+
+    immutable_map insert(pair&& kvp) &&
+    {
+        insert_in_place(pair_storage(get_allocator(), std::move(kvp)));
+        return std::move(*this);
+    }
+
+    immutable_map erase(const K& key) const&
+    {
+        return erase_imp(key);
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    immutable_map erase(const Key& key) const&
+    {
+        return erase_imp(key);
+    }
+
+    immutable_map erase(const K& key) &&
+    {
+        erase_in_place(key);
+        return std::move(*this);
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    immutable_map erase(const Key& key) &&
+    {
+        erase_in_place(key);
+        return std::move(*this);
+    }
+
+    // erases the elements with keys between lo and hi in O(log n) through
+    // split and join, keeping every subtree outside the range; without
+    // OrderStatistics the erased elements are walked once to count them
+    immutable_map erase_range(const K& lo, const K& hi, bounds_t bounds = INCLUDE_LOWER) const
+    {
+        return erase_range_imp(lo, hi, bounds);
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    immutable_map erase_range(const Key& lo, const Key& hi, bounds_t bounds = INCLUDE_LOWER) const
+    {
+        return erase_range_imp(lo, hi, bounds);
+    }
+
+    // erases the elements for which pred(pair) returns true, calling pred
+    // once per element in key order; the map is rebuilt in O(n) with one node
+    // per element kept, except in subtrees that lose nothing and are shared
+    template <class Pred>
+    immutable_map erase_if(Pred pred) const
+    {
+        size_t erased = 0;
+        auto result = erase_if_imp(subtree(root_), pred, erased);
+        if (erased == 0) return *this;
+        return immutable_map(*this, blacken(std::move(result)).root_, size_ - erased);
+    }
+
+    // a transient for a batch of edits starting from this map
+    transient as_transient() const
+    {
+        return transient(*this);
+    }
+
+    // cuts the map into the elements less than key and those greater than
+    // key, also returning an iterator to the element with key itself, or
+    // end(); the parts share every subtree the cut does not cross. Without
+    // OrderStatistics the smaller part is walked once to learn the sizes
+    std::tuple<immutable_map, const_iterator, immutable_map> split(const K& key) const
+    {
+        return split_imp(key);
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    std::tuple<immutable_map, const_iterator, immutable_map> split(const Key& key) const
+    {
+        return split_imp(key);
+    }
+
+    // glues maps whose keys are all less, respectively all greater, than the
+    // key of pivot in O(log n), sharing the subtrees of both; the result takes
+    // the comparator and allocator of left, and maps out of order throw
+    // std::invalid_argument
+    static immutable_map join(const immutable_map& left, const pair& pivot, const immutable_map& right)
+    {
+        left.check_order(left.root_.get(), &pivot.first, right.root_.get());
+        auto joined = left.join_imp(subtree(left.root_), pair_storage(left.get_allocator(), pivot), subtree(right.root_));
+        return immutable_map(left, left.blacken(std::move(joined)).root_, left.size_ + right.size_ + 1);
+    }
+
+    // same for two maps, the last element of left serving as the pivot
+    static immutable_map join(const immutable_map& left, const immutable_map& right)
+    {
+        left.check_order(left.root_.get(), nullptr, right.root_.get());
+        auto joined = left.join_imp(subtree(left.root_), subtree(right.root_));
+        return immutable_map(left, left.blacken(std::move(joined)).root_, left.size_ + right.size_);
+    }
+
+    // the set operations below split b around the keys of a, in
+    // O(m log(n / m + 1)) for maps of sizes m <= n. Subtrees that a and b
+    // share are taken, or dropped, as they are, so merge(v, v) should give v;
+    // without OrderStatistics such subtrees are walked once to count them.
+    // The result takes the comparator and allocator of a. PARALLEL runs
+    // independent halves of large inputs on separate threads, one per fork,
+    // and may call merge concurrently; it has no effect with
+    // single_thread_policy or with a stateful allocator
+
+    // elements of either map; keys in both get merge(a_value, b_value)
+    template <class Merge>
+    static immutable_map union_with(const immutable_map& a, const immutable_map& b, Merge merge, execution_t execution = SEQUENTIAL)
+    {
+        size_t common = 0;
+        auto result = a.union_imp(subtree(a.root_), subtree(b.root_), merge, common, fork_levels(execution));
+        return immutable_map(a, a.blacken(std::move(result)).root_, a.size_ + b.size_ - common);
+    }
+
+    // elements whose keys are in both maps, with merge(a_value, b_value)
+    template <class Merge>
+    static immutable_map intersection_with(const immutable_map& a, const immutable_map& b, Merge merge, execution_t execution = SEQUENTIAL)
+    {
+        size_t common = 0;
+        auto result = a.intersection_imp(subtree(a.root_), subtree(b.root_), merge, common, fork_levels(execution));
+        return immutable_map(a, a.blacken(std::move(result)).root_, common);
+    }
+
+    // elements of a whose keys are not in b
+    static immutable_map difference(const immutable_map& a, const immutable_map& b, execution_t execution = SEQUENTIAL)
+    {
+        size_t common = 0;
+        auto result = a.difference_imp(subtree(a.root_), subtree(b.root_), common, fork_levels(execution));
+        return immutable_map(a, a.blacken(std::move(result)).root_, a.size_ - common);
+    }
+
+    // reports in key order how b differs from a: on_added(b_pair) and
+    // on_removed(a_pair) for keys in only one of them, on_changed(a_pair,
+    // b_pair) for keys whose values differ, as told by T's operator == (or
+    // by their bytes when T has none but is trivially copyable, and
+    // otherwise for every pair of distinct elements).
+    // Subtrees that both maps share are skipped without being visited, so
+    // for versions derived from each other the cost follows the number of
+    // changes rather than the size of the maps
+    template <class Added, class Removed, class Changed>
+    static void diff(const immutable_map& a, const immutable_map& b, Added on_added, Removed on_removed, Changed on_changed)
+    {
+        const auto& comp = a.compare_base::key_comp();
+        diff_cursor old_items(a.root_.get()), new_items(b.root_.get());
+        while (!old_items.empty() && !new_items.empty())
+        {
+            auto x = old_items.top();
+            auto y = new_items.top();
+            if (!old_items.is_element() && !new_items.is_element())
+            {
+                if (x == y)
+                {
+                    old_items.pop();
+                    new_items.pop();
+                    continue;
+                }
+                // both cover the keys from the current position up to their
+                // bound: open the one reaching further, or both
+                auto bx = old_items.bound();
+                auto by = new_items.bound();
+                if (!bx || (by && !comp(bx->get_key(), by->get_key()))) old_items.expand();
+                if (!by || (bx && !comp(by->get_key(), bx->get_key()))) new_items.expand();
+            }
+            else if (!old_items.is_element() && !a.precedes(y, x))
+            {
+                old_items.expand();
+            }
+            else if (!new_items.is_element() && !a.precedes(x, y))
+            {
+                new_items.expand();
+            }
+            else if (!old_items.is_element() || (new_items.is_element() && comp(y->get_key(), x->get_key())))
+            {
+                on_added(y->get_pair());
+                new_items.pop();
+            }
+            else if (!new_items.is_element() || comp(x->get_key(), y->get_key()))
+            {
+                on_removed(x->get_pair());
+                old_items.pop();
+            }
+            else
+            {
+                const auto& old_pair = x->get_pair();
+                const auto& new_pair = y->get_pair();
+                if (&old_pair != &new_pair && !same_value(old_pair.second, new_pair.second)) on_changed(old_pair, new_pair);
+                old_items.pop();
+                new_items.pop();
+            }
+        }
+        old_items.drain(on_removed);
+        new_items.drain(on_added);
+    }
+
+    // the updates below descend once and return *this, sharing its root,
+    // when the value comes back equal to the current one (for a T with
+    // operator ==, or a trivially copyable one, see same_value)
+
+    // replaces the value of key with fn(value), when key is present
+    template <class Function>
+    immutable_map update(const K& key, Function fn) const
+    {
+        return update_imp(key, fn);
+    }
+
+    template <class Key, class Function, class C = Compare, class = typename C::is_transparent>
+    immutable_map update(const Key& key, Function fn) const
+    {
+        return update_imp(key, fn);
+    }
+
+    // inserts fn_if_absent() under key, or replaces its value with
+    // fn_if_present(value)
+    template <class Absent, class Present>
+    immutable_map upsert(const K& key, Absent fn_if_absent, Present fn_if_present) const
+    {
+        path p;
+        if (find(p, key)) return replace_value(p, fn_if_present);
+        pair_storage kvp(get_allocator(), key, fn_if_absent());
+        return immutable_map(*this, insert_imp(std::move(kvp), p, false), size_ + 1);
+    }
+
+    // inserts a value constructed from args unless key is present
+    template <class... Args>
+    immutable_map try_emplace(const K& key, Args&&... args) const
+    {
+        path p;
+        if (find(p, key)) return *this;
+        pair_storage kvp(get_allocator(), std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+        return immutable_map(*this, insert_imp(std::move(kvp), p, false), size_ + 1);
+    }
+
+    bool contains(const K& key) const
+    {
+        return find_node(key) != nullptr;
+    }
+
+    template <class Key, class C = Compare, class = typename C::is_transparent>
+    bool contains(const Key& key) const
+    {
+        return find_node(key) != nullptr;
+    }
+
+    // looks up every key in [first, last) and writes to out whether it is
+    // present; the searches run interleaved so their cache misses overlap
+    template <class ForwardIt, class OutputIt>
+    OutputIt contains_many(ForwardIt first, ForwardIt last, OutputIt out) const
+    {
+        find_many_imp(first, last, [&out](const node* match) { *out++ = match != nullptr; });
+        return out;
+    }
+
+    // like contains_many, writing a pointer to the value or nullptr
+    template <class ForwardIt, class OutputIt>
+    OutputIt find_many(ForwardIt first, ForwardIt last, OutputIt out) const
+    {
+        find_many_imp(first, last, [&out](const node* match) {
+            *out++ = match ? &match->get_pair().second : nullptr;
+        });
+        return out;
+    }
+
+    template <class Function>
+    void foreach(Function f) const
+    {
+        if (root_) root_->foreach(f);
+    }
+
+    template <class Function, class Pred1, class Pred2>
+    [[deprecated("use for_range")]]
+    void foreach(Function f, Pred1 take_from, Pred2 take_to) const
+    {
+        if (root_) root_->foreach(f, take_from, take_to);
+    }
+
+    // calls f on the elements with keys between lo and hi, in order, until f
+    // returns false; subtrees known to lie inside the range are walked without
+    // comparing keys, so visiting the first n elements costs O(log(size) + n)
+    template <class Function>
+    void for_range(const K& lo, const K& hi, Function f, bounds_t bounds = INCLUDE_LOWER) const
+    {
+        for_range_imp(root_.get(), lo, hi, f, bounds, true, true);
+    }
+
+    template <class Key, class Function, class C = Compare, class = typename C::is_transparent>
+    void for_range(const Key& lo, const Key& hi, Function f, bounds_t bounds = INCLUDE_LOWER) const
+    {
+        for_range_imp(root_.get(), lo, hi, f, bounds, true, true);
+    }
+
+    /*void validate() const
+    {
+        if (root_ && root_->is_red()) throw std::runtime_error("root is red");
+        if (root_) root_->validate();
+    }*/
+
+private:
+    template <class Map>
+    friend class atomic_immutable_map;
+    template <class Map>
+    friend class versioned_map;
+
+    typedef immutable_map_detail::compare_holder<Compare> compare_base;
+    typedef immutable_map_detail::allocator_holder<Allocator> allocator_base;
+
+    // with the natural ordering on arithmetic keys, or on keys providing <=>,
+    // a single three-way comparison per level also detects the match
+    template <class Key>
+    static constexpr bool use_three_way =
+        (std::is_same<Compare, std::less<K>>::value || std::is_same<Compare, std::less<>>::value) &&
+#ifdef IMMUTABLE_MAP_THREE_WAY_COMPARISON
+        ((std::is_arithmetic<K>::value && std::is_arithmetic<Key>::value) ||
+         std::three_way_comparable_with<Key, K, std::weak_ordering>);
+#else
+        std::is_arithmetic<K>::value && std::is_arithmetic<Key>::value;
+#endif
+
+    template <class Key>
+    static int compare_three_way(const Key& a, const K& b)
+    {
+#ifdef IMMUTABLE_MAP_THREE_WAY_COMPARISON
+        if constexpr (!std::is_arithmetic<K>::value || !std::is_arithmetic<Key>::value)
+        {
+            auto c = a <=> b;
+            return c < 0 ? -1 : c > 0;
+        }
+#endif
+        return (b < a) - (a < b);
+    }
+
+    enum color_t { BLACK = 0, RED = 1 };
+    enum side_t { LEFT = 0, RIGHT = 1 };
+
+    class node;
+
+    // nodes and shared pairs are allocated with a rebound copy of the map
+    // allocator, which they keep so that they can free themselves
+    template <class U, class... Args>
+    static U* create(const Allocator& alloc, Args&&... args)
+    {
+        typedef typename std::allocator_traits<Allocator>::template rebind_alloc<U> alloc_t;
+        typedef std::allocator_traits<alloc_t> traits;
+        alloc_t a(alloc);
+        U* ptr = traits::allocate(a, 1);
+        try
+        {
+            traits::construct(a, ptr, alloc, std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            traits::deallocate(a, ptr, 1);
+            throw;
+        }
+        return ptr;
+    }
+
+    template <class U>
+    static void destroy(const U* ptr)
+    {
+        typedef typename std::allocator_traits<Allocator>::template rebind_alloc<U> alloc_t;
+        typedef std::allocator_traits<alloc_t> traits;
+        alloc_t a(ptr->get_allocator());
+        U* p = const_cast<U*>(ptr);
+        traits::destroy(a, p);
+        traits::deallocate(a, p, 1);
+    }
+
+    class ref_count
+    {
+    public:
+        ref_count() : refs_(0) {}
+        ref_count(const ref_count&) : refs_(0) {}
+
+        void add_ref() const
+        {
+            ThreadingPolicy::increment(refs_);
+        }
+
+        // returns true when the last reference has been dropped
+        bool drop_ref() const
+        {
+            return ThreadingPolicy::decrement(refs_);
+        }
+
+        bool is_unique() const
+        {
+            return ThreadingPolicy::is_unique(refs_);
+        }
+
+    private:
+        mutable typename ThreadingPolicy::counter_type refs_;
+    };
+
+    // owning pointer to a node; the reference count lives in the node itself
+    template <class N>
+    class intrusive_ptr
+    {
+    public:
+        intrusive_ptr() : ptr_(nullptr) {}
+        intrusive_ptr(std::nullptr_t) : ptr_(nullptr) {}
+
+        explicit intrusive_ptr(N* ptr)
+          : ptr_(ptr)
+        {
+            if (ptr_) ptr_->add_ref();
+        }
+
+        intrusive_ptr(const intrusive_ptr& other)
+          : ptr_(other.ptr_)
+        {
+            if (ptr_) ptr_->add_ref();
+        }
+
+        intrusive_ptr(intrusive_ptr&& other)
+          : ptr_(other.ptr_)
+        {
+            other.ptr_ = nullptr;
+        }
+
+        template <class M>
+        intrusive_ptr(const intrusive_ptr<M>& other)
+          : intrusive_ptr(other.get())
+        {}
+
+        template <class M>
+        intrusive_ptr(intrusive_ptr<M>&& other)
+          : ptr_(other.detach())
+        {}
+
+        ~intrusive_ptr()
+        {
+            if (ptr_) ptr_->release();
+        }
+
+        intrusive_ptr& operator = (intrusive_ptr other)
+        {
+            std::swap(ptr_, other.ptr_);
+            return *this;
+        }
+
+        N* get() const { return ptr_; }
+        N* operator -> () const { return ptr_; }
+        N& operator * () const { return *ptr_; }
+        explicit operator bool () const { return ptr_ != nullptr; }
+
+        // gives up ownership without touching the reference count
+        N* detach()
+        {
+            N* ptr = ptr_;
+            ptr_ = nullptr;
+            return ptr;
+        }
+
+    private:
+        N* ptr_;
+    };
+
+    typedef intrusive_ptr<node> node_ptr;
+    typedef intrusive_ptr<const node> const_node_ptr;
+
+    // small trivially copyable pairs are stored inside the node, so a lookup
+    // reads the key from the node it is already visiting
+    class inline_pair
+    {
+    public:
+        template <class... Args>
+        explicit inline_pair(const Allocator&, Args&&... args)
+          : kvp_(std::forward<Args>(args)...)
+        {}
+
+        const pair& get() const { return kvp_; }
+
+    private:
+        pair kvp_;
+    };
+
+    // other pairs are allocated once and shared by every clone of the node,
+    // so path copying never copies a key or a value
+    class shared_pair
+    {
+    public:
+        template <class... Args>
+        explicit shared_pair(const Allocator& alloc, Args&&... args)
+          : kvp_(create<box>(alloc, std::forward<Args>(args)...))
+        {}
+
+        const pair& get() const { return kvp_->kvp_; }
+
+        static size_t box_size() { return sizeof(box); }
+
+    private:
+        class box : public ref_count, public allocator_base
+        {
+        public:
+            template <class... Args>
+            explicit box(const Allocator& alloc, Args&&... args)
+              : allocator_base(alloc),
+                kvp_(std::forward<Args>(args)...)
+            {}
+
+            void release() const
+            {
+                if (this->drop_ref()) destroy(this);
+            }
+
+            pair kvp_;
+        };
+
+        intrusive_ptr<const box> kvp_;
+    };
+
+    class counted_node_base
+    {
+    public:
+        size_t get_count() const { return count_; }
+
+    protected:
+        size_t count_ = 1;
+    };
+
+    class uncounted_node_base
+    {};
+
+    typedef typename std::conditional<OrderStatistics, counted_node_base, uncounted_node_base>::type node_count_base;
+
+    static size_t subtree_size(const node* n)
+    {
+        return n ? n->get_count() : 0;
+    }
+
+    template <class A>
+    class aggregated_node_base
+    {
+    public:
+        const typename A::value_type& get_aggregate() const { return aggregate_; }
+
+    protected:
+        typename A::value_type aggregate_ = A::identity();
+    };
+
+    class unaggregated_node_base
+    {};
+
+    typedef typename std::conditional<has_aggregate, aggregated_node_base<Aggregate>, unaggregated_node_base>::type node_aggregate_base;
+
+    static constexpr bool is_pair_inline =
+        std::is_trivially_copyable<K>::value &&
+        std::is_trivially_copyable<T>::value &&
+        sizeof(pair) <= 64;
+
+    typedef typename std::conditional<is_pair_inline, inline_pair, shared_pair>::type pair_storage;
+
+    class node : public node_count_base, public node_aggregate_base, public ref_count, public allocator_base
+    {
+    public:
+        node(const Allocator& alloc, pair_storage&& kvp, const_node_ptr&& left_child, const_node_ptr&& right_child, color_t color)
+          : allocator_base(alloc),
+            color_(color),
+            children_{ std::move(left_child), std::move(right_child) },
+            kvp_(std::move(kvp))
+        {
+            update();
+        }
+
+        node(const Allocator& alloc, const node& other)
+          : node_count_base(other),
+            node_aggregate_base(other),
+            allocator_base(alloc),
+            color_(other.color_),
+            children_{ other.children_[0], other.children_[1] },
+            kvp_(other.kvp_)
+        {}
+
+        void release() const
+        {
+            if (this->drop_ref()) destroy(this);
+        }
+
+        // drops a reference like release(), but a node freed this way hands
+        // its references to the children over instead of dropping them
+        bool release_shallow(std::array<const node*, 2>& children) const
+        {
+            if (!this->drop_ref()) return false;
+            auto self = const_cast<node*>(this);
+            children = { self->children_[LEFT].detach(), self->children_[RIGHT].detach() };
+            destroy(this);
+            return true;
+        }
+
+        const K& get_key() const
+        {
+            return kvp_.get().first;
+        }
+
+        const pair& get_pair() const
+        {
+            return kvp_.get();
+        }
+
+        const const_node_ptr& get_child(int side) const
+        {
+            return children_[side];
+        }
+
+        color_t get_color() const { return color_; }
+        bool is_red() const { return color_ == RED; }
+        bool is_black() const { return color_ == BLACK; }
+        bool has_red_child() const
+        {
+            return (children_[0] && children_[0]->is_red()) || (children_[1] && children_[1]->is_red());
+        }
+
+        void set_pair(pair_storage&& kvp)
+        {
+            kvp_ = std::move(kvp);
+            update();
+        }
+
+        void set_child(int side, const_node_ptr child)
+        {
+            children_[side] = std::move(child);
+            update();
+        }
+
+        // refreshes what the node records about its subtree; children must be
+        // final before they are attached
+        void update()
+        {
+            if constexpr (OrderStatistics)
+                this->count_ = 1 + subtree_size(children_[LEFT].get()) + subtree_size(children_[RIGHT].get());
+            if constexpr (has_aggregate)
+            {
+                auto aggregate = Aggregate::lift(get_key(), get_pair().second);
+                if (children_[LEFT]) aggregate = Aggregate::combine(children_[LEFT]->get_aggregate(), aggregate);
+                if (children_[RIGHT]) aggregate = Aggregate::combine(aggregate, children_[RIGHT]->get_aggregate());
+                this->aggregate_ = std::move(aggregate);
+            }
+        }
+
+        void set_color(color_t color)
+        {
+            color_ = color;
+        }
+
+        node_ptr clone() const
+        {
+            return node_ptr(create<node>(this->get_allocator(), *this));
+        }
+
+        template <class Function>
+        void foreach(Function& f) const
+        {
+            if (get_child(LEFT)) get_child(LEFT)->foreach(f);
+            f(get_pair());
+            if (get_child(RIGHT)) get_child(RIGHT)->foreach(f);
+        }
+
+        // returns false as soon as f does
+        template <class Function>
+        bool foreach_while(Function& f) const
+        {
+            if (get_child(LEFT) && !get_child(LEFT)->foreach_while(f)) return false;
+            if (!visit(f, get_pair())) return false;
+            return !get_child(RIGHT) || get_child(RIGHT)->foreach_while(f);
+        }
+
+        template <class Function, class Pred1, class Pred2>
+        void foreach(const Function& f, const Pred1& take_from, const Pred2& take_to) const
+        {
+            bool tf = take_from(get_key());
+            bool tt = take_to(get_key());
+            if (tf && get_child(LEFT)) get_child(LEFT)->foreach(f, take_from, take_to);
+            if (tf && tt) f(get_pair());
+            if (tt && get_child(RIGHT)) get_child(RIGHT)->foreach(f, take_from, take_to);
+        }
+
+        /*int validate() const
+        {
+            int depth = 1, depth1, depth2;
+            if (is_red())
+            {
+                depth = 0;
+                if (get_child(LEFT) && get_child(LEFT)->is_red())
+                    throw std::runtime_error("red node with red child");
+                if (get_child(RIGHT) && get_child(RIGHT)->is_red())
+                    throw std::runtime_error("red node with red child");
+            }
+            if (get_child(LEFT)) depth1 = get_child(LEFT)->validate();
+            else depth1 = 0;
+            if (get_child(RIGHT)) depth2 = get_child(RIGHT)->validate();
+            else depth2 = 0;
+            if (depth1 != depth2) throw std::runtime_error("invalid black depth");
+            return depth1 + depth;
+        }*/
+
+        color_t color_;
+        const_node_ptr children_[2];
+        pair_storage kvp_;
+    };
+
+    // the nodes on a path are borrowed from a tree that outlives the path;
+    // for each node the path also records the side taken towards the next one.
+    // An in-place path also counts the nodes, from the root down, that are
+    // referenced only along the path itself: those may be modified in place
+    class path
+    {
+    public:
+        explicit path(bool in_place = false)
+        {
+            size_ = 0;
+            editable_ = 0;
+            in_place_ = in_place;
+        }
+
+        const node* get_node() const
+        {
+            if (size_ > 0) return path_[size_ - 1];
+            return nullptr;
+        }
+        const node* get_parent() const
+        {
+            if (size_ > 1) return path_[size_ - 2];
+            return nullptr;
+        }
+        const node* get_grand_parent() const
+        {
+            if (size_ > 2) return path_[size_ - 3];
+            return nullptr;
+        }
+        const node* operator[](size_t n) const
+        {
+            return path_[n];
+        }
+
+        int get_side() const { return sides_[size_ - 1]; }
+        int get_parent_side() const { return sides_[size_ - 2]; }
+        void set_side(int side) { sides_[size_ - 1] = (unsigned char)side; }
+
+        bool is_editable() const { return size_ <= editable_; }
+        bool is_parent_editable() const { return size_ - 1 <= editable_; }
+
+        void push(const node* node, int side)
+        {
+            if (in_place_ && editable_ == size_ && node->is_unique()) ++editable_;
+            path_[size_] = node;
+            sides_[size_++] = (unsigned char)side;
+        }
+        void pop() { truncate(size_ - 1); }
+        void truncate(size_t size)
+        {
+            size_ = size;
+            if (editable_ > size_) editable_ = size_;
+        }
+        bool empty() const { return size_ == 0; }
+        size_t size() const { return size_; }
+
+        // popping keeps the recorded sides: walk them again from another root
+        // with the same shape down to the given depth. The new root must have
+        // been built by the current operation, so its nodes are all editable
+        void retrace(const node* root, size_t depth)
+        {
+            auto node = root;
+            for (size_ = 0; size_ < depth; ++size_)
+            {
+                path_[size_] = node;
+                node = node->get_child(sides_[size_]).get();
+            }
+            editable_ = depth;
+        }
+
+    private:
+        std::array<const node*, sizeof(size_t) * 16> path_;
+        std::array<unsigned char, sizeof(size_t) * 16> sides_;
+        size_t size_;
+        size_t editable_;
+        bool in_place_;
+    };
+
+    const_node_ptr root_;
+    size_t   size_;
+
+    // a map with the comparator and allocator of other
+    immutable_map(const immutable_map& other, const_node_ptr&& root, size_t size)
+      : compare_base(other.key_comp()),
+        allocator_base(other.get_allocator())
+    {
+        root_ = std::move(root);
+        size_ = size;
+    }
+
+    // walks a batch of searches in lockstep, one level at a time, prefetching
+    // the next node of each search before moving on to the others
+    template <class ForwardIt, class Function>
+    void find_many_imp(ForwardIt first, ForwardIt last, Function f) const
+    {
+        static constexpr size_t batch_size = 16;
+        const auto& comp = compare_base::key_comp();
+        ForwardIt keys[batch_size];
+        const node* nodes[batch_size];
+        const node* matches[batch_size];
+        size_t active[batch_size];
+        while (first != last)
+        {
+            size_t batch = 0;
+            for (; batch < batch_size && first != last; ++batch, ++first)
+            {
+                keys[batch] = first;
+                nodes[batch] = root_.get();
+                matches[batch] = nullptr;
+                active[batch] = batch;
+            }
+            size_t count = root_ ? batch : 0;
+            while (count > 0)
+            {
+                for (size_t i = 0; i < count;)
+                {
+                    auto lane = active[i];
+                    auto node = nodes[lane];
+                    const auto& key = *keys[lane];
+                    const immutable_map::node* next;
+                    if constexpr (use_three_way<typename std::decay<decltype(key)>::type>)
+                    {
+                        auto c = compare_three_way(key, node->get_key());
+                        if (c == 0) matches[lane] = node;
+                        next = c == 0 ? nullptr : node->get_child(c < 0 ? LEFT : RIGHT).get();
+                    }
+                    else if (comp(node->get_key(), key))
+                    {
+                        next = node->get_child(RIGHT).get();
+                    }
+                    else
+                    {
+                        matches[lane] = node;
+                        next = node->get_child(LEFT).get();
+                    }
+                    if (next)
+                    {
+                        IMMUTABLE_MAP_PREFETCH(next);
+                        nodes[lane] = next;
+                        ++i;
+                        continue;
+                    }
+                    if (!use_three_way<typename std::decay<decltype(key)>::type> &&
+                        matches[lane] && comp(key, matches[lane]->get_key()))
+                    {
+                        matches[lane] = nullptr;
+                    }
+                    active[i] = active[--count];
+                }
+            }
+            for (size_t i = 0; i < batch; ++i) f(matches[i]);
+        }
+    }
+
+    // the iterator ends on the last node visited for which the descent went
+    // left, i.e. the first node not less than (or greater than) key
+    template <class Key>
+    const_iterator bound_imp(const Key& key, bool upper) const
+    {
+        const auto& comp = compare_base::key_comp();
+        const_iterator it(root_.get());
+        size_t candidate = 0;
+        auto node = root_.get();
+        while (node)
+        {
+            it.stack_[it.size_++] = node;
+            bool left = upper ? comp(key, node->get_key()) : !comp(node->get_key(), key);
+            if (left) candidate = it.size_;
+            node = node->get_child(left ? LEFT : RIGHT).get();
+        }
+        it.size_ = candidate;
+        return it;
+    }
+
+    template <class Key>
+    const_iterator find_imp(const Key& key) const
+    {
+        auto it = bound_imp(key, false);
+        if (it.size_ && compare_base::key_comp()(key, it->first)) return end();
+        return it;
+    }
+
+    template <class Key>
+    std::pair<const_iterator, const_iterator> equal_range_imp(const Key& key) const
+    {
+        auto first = bound_imp(key, false);
+        auto last = first;
+        if (last.size_ && !compare_base::key_comp()(key, last->first)) ++last;
+        return std::make_pair(first, last);
+    }
+
+    // functions returning nothing never stop a visit
+    template <class Function>
+    static bool visit(Function& f, const pair& kvp)
+    {
+        if constexpr (std::is_void<decltype(f(kvp))>::value)
+        {
+            f(kvp);
+            return true;
+        }
+        else
+        {
+            return f(kvp);
+        }
+    }
+
+    // check_lo / check_hi tell whether the keys of the subtree may still fall
+    // below lo / above hi; when neither can, the subtree is walked as is
+    template <class Key, class Function>
+    bool for_range_imp(const node* n, const Key& lo, const Key& hi, Function& f, bounds_t bounds, bool check_lo, bool check_hi) const
+    {
+        if (!n) return true;
+        if (!check_lo && !check_hi) return n->foreach_while(f);
+        const auto& comp = compare_base::key_comp();
+        const auto& key = n->get_key();
+        bool above_lo = !check_lo || ((bounds & INCLUDE_LOWER) ? !comp(key, lo) : comp(lo, key));
+        bool below_hi = !check_hi || ((bounds & INCLUDE_UPPER) ? !comp(hi, key) : comp(key, hi));
+        if (above_lo && !for_range_imp(n->get_child(LEFT).get(), lo, hi, f, bounds, check_lo, !below_hi)) return false;
+        if (above_lo && below_hi && !visit(f, n->get_pair())) return false;
+        if (below_hi) return for_range_imp(n->get_child(RIGHT).get(), lo, hi, f, bounds, !above_lo, check_hi);
+        return true;
+    }
+
+    // number of keys less than key, or not greater than key when inclusive
+    template <class Key>
+    size_t count_below(const Key& key, bool inclusive) const
+    {
+        static_assert(OrderStatistics, "rank() and count_range() require OrderStatistics");
+        const auto& comp = compare_base::key_comp();
+        size_t count = 0;
+        auto node = root_.get();
+        while (node)
+        {
+            bool left = inclusive ? comp(key, node->get_key()) : !comp(node->get_key(), key);
+            if (!left) count += subtree_size(node->get_child(LEFT).get()) + 1;
+            node = node->get_child(left ? LEFT : RIGHT).get();
+        }
+        return count;
+    }
+
+    template <class Key>
+    size_t count_range_imp(const Key& lo, const Key& hi, bounds_t bounds) const
+    {
+        auto below_hi = count_below(hi, (bounds & INCLUDE_UPPER) != 0);
+        auto below_lo = count_below(lo, (bounds & INCLUDE_LOWER) == 0);
+        return below_hi > below_lo ? below_hi - below_lo : 0;
+    }
+
+    // same descent as for_range_imp, taking the stored aggregate of every
+    // subtree found to lie inside the range
+    template <class Key>
+    aggregate_value reduce_range_imp(const node* n, const Key& lo, const Key& hi, bounds_t bounds, bool check_lo, bool check_hi) const
+    {
+        static_assert(has_aggregate, "reduce_range() requires an Aggregate policy");
+        if (!n) return Aggregate::identity();
+        if (!check_lo && !check_hi) return n->get_aggregate();
+        const auto& comp = compare_base::key_comp();
+        const auto& key = n->get_key();
+        bool above_lo = !check_lo || ((bounds & INCLUDE_LOWER) ? !comp(key, lo) : comp(lo, key));
+        bool below_hi = !check_hi || ((bounds & INCLUDE_UPPER) ? !comp(hi, key) : comp(key, hi));
+        auto aggregate = Aggregate::identity();
+        if (above_lo)
+            aggregate = reduce_range_imp(n->get_child(LEFT).get(), lo, hi, bounds, check_lo, !below_hi);
+        if (above_lo && below_hi)
+            aggregate = Aggregate::combine(aggregate, Aggregate::lift(key, n->get_pair().second));
+        if (below_hi)
+            aggregate = Aggregate::combine(aggregate, reduce_range_imp(n->get_child(RIGHT).get(), lo, hi, bounds, !above_lo, check_hi));
+        return aggregate;
+    }
+
+    template <class Key>
+    const T& at_imp(const Key& key) const
+    {
+        auto match = find_node(key);
+        if (!match) throw std::out_of_range("missing key");
+        return match->get_pair().second;
+    }
+
+    template <class Key>
+    immutable_map erase_imp(const Key& key) const
+    {
+        path p;
+        auto match = find(p, key);
+        if (!match) return *this;
+        auto new_root = erase_imp(p);
+        return immutable_map(*this, std::move(new_root), size_ - 1);
+    }
+
+    // the in-place edits modify the nodes that no other map can reach and
+    // copy the others; if an allocation throws, the map may be left
+    // unbalanced or partially updated
+    template <class Key>
+    void erase_in_place(const Key& key)
+    {
+        path p(true);
+        if (!find(p, key)) return;
+        root_ = erase_imp(p);
+        --size_;
+    }
+
+    // a subtree with its black height: the number of black nodes on every
+    // path from its root down to a leaf
+    struct subtree
+    {
+        subtree() : height_(0) {}
+
+        explicit subtree(const_node_ptr root)
+          : root_(std::move(root)),
+            height_(0)
+        {
+            for (auto n = root_.get(); n; n = n->get_child(LEFT).get()) height_ += n->is_black();
+        }
+
+        subtree(const_node_ptr root, int height)
+          : root_(std::move(root)),
+            height_(height)
+        {}
+
+        const_node_ptr root_;
+        int height_;
+    };
+
+    // both subtrees of a red-black tree may serve as roots once their root
+    // is black
+    subtree blacken(subtree t) const
+    {
+        if (!t.root_ || t.root_->is_black()) return t;
+        auto root = make_mutable(t.root_.get(), t.root_->is_unique());
+        root->set_color(BLACK);
+        return subtree(std::move(root), t.height_ + 1);
+    }
+
+    // throws unless the keys under left, then *key if given, then the keys
+    // under right are increasing
+    void check_order(const node* left, const K* key, const node* right) const
+    {
+        const auto& comp = compare_base::key_comp();
+        while (left && left->get_child(RIGHT)) left = left->get_child(RIGHT).get();
+        while (right && right->get_child(LEFT)) right = right->get_child(LEFT).get();
+        if ((left && key && !comp(left->get_key(), *key)) ||
+            (key && right && !comp(*key, right->get_key())) ||
+            (left && right && !comp(left->get_key(), right->get_key())))
+        {
+            throw std::invalid_argument("maps are not ordered");
+        }
+    }
+
+    // red-black join: the pivot is hung from the taller tree, at the black
+    // node of its inner spine as tall as the other tree, and the red-red
+    // conflicts this may cause are rotated away on the way back up
+    subtree join_imp(subtree left, const pair_storage& kvp, subtree right) const
+    {
+        left = blacken(std::move(left));
+        right = blacken(std::move(right));
+        if (left.height_ == right.height_)
+        {
+            auto height = left.height_ + 1;
+            return subtree(node_ptr(create<node>(get_allocator(), pair_storage(kvp), std::move(left.root_), std::move(right.root_), BLACK)), height);
+        }
+        auto& tall = left.height_ > right.height_ ? left : right;
+        auto& other = left.height_ > right.height_ ? right : left;
+        auto side = left.height_ > right.height_ ? RIGHT : LEFT;
+        auto root = join_along(tall.root_.get(), tall.height_, kvp, other, side, tall.root_->is_unique());
+        auto height = tall.height_;
+        if (root->is_red() && root->get_child(side) && root->get_child(side)->is_red())
+        {
+            root->set_color(BLACK);
+            ++height;
+        }
+        return subtree(std::move(root), height);
+    }
+
+    // t is editable when only the nodes being rebuilt refer to it
+    node_ptr join_along(const node* t, int height, const pair_storage& kvp, const subtree& other, int side, bool editable) const
+    {
+        if ((!t || t->is_black()) && height == other.height_)
+        {
+            const_node_ptr children[2];
+            children[side] = other.root_;
+            children[1 - side] = const_node_ptr(t);
+            return node_ptr(create<node>(get_allocator(), pair_storage(kvp), std::move(children[LEFT]), std::move(children[RIGHT]), RED));
+        }
+        auto new_t = make_mutable(t, editable);
+        auto next = t->get_child(side).get();
+        auto child = join_along(next, height - t->is_black(), kvp, other, side, editable && next && next->is_unique());
+        auto grand_child = child->get_child(side).get();
+        if (t->is_black() && child->is_red() && grand_child && grand_child->is_red())
+        {
+            auto new_grand_child = make_mutable(grand_child, grand_child->is_unique());
+            new_grand_child->set_color(BLACK);
+            child->set_child(side, new_grand_child);
+            new_t->set_child(side, child->get_child(1 - side));
+            child->set_child(1 - side, new_t);
+            return child;
+        }
+        new_t->set_child(side, child);
+        return new_t;
+    }
+
+    // joins two subtrees without a pivot, borrowing the last element of left
+    subtree join_imp(subtree left, subtree right) const
+    {
+        if (!left.root_) return right;
+        if (!right.root_) return left;
+        auto last = left.root_.get();
+        while (last->get_child(RIGHT)) last = last->get_child(RIGHT).get();
+        auto kvp = last->kvp_;
+        immutable_map rest(*this, blacken(std::move(left)).root_, 1);
+        rest = std::move(rest).erase(kvp.get().first);
+        return join_imp(subtree(std::move(rest.root_)), kvp, std::move(right));
+    }
+
+    // values without operator == are compared by their bytes when trivially
+    // copyable, as inline pairs are copied into every node cloned along a
+    // path, and are otherwise always taken as changed
+    static bool same_value(const T& a, const T& b)
+    {
+        if constexpr (immutable_map_detail::is_equality_comparable<T>::value)
+            return a == b;
+        else if constexpr (std::is_trivially_copyable<T>::value)
+            return std::memcmp(&a, &b, sizeof(T)) == 0;
+        return false;
+    }
+
+    template <class Key, class Function>
+    immutable_map update_imp(const Key& key, Function& fn) const
+    {
+        path p;
+        if (!find(p, key)) return *this;
+        return replace_value(p, fn);
+    }
+
+    // the matching node is on top of the path
+    template <class Function>
+    immutable_map replace_value(path& p, Function& fn) const
+    {
+        const auto& kvp = p.get_node()->get_pair();
+        T value(fn(kvp.second));
+        if (same_value(value, kvp.second)) return *this;
+        pair_storage new_kvp(get_allocator(), kvp.first, std::move(value));
+        return immutable_map(*this, insert_imp(std::move(new_kvp), p, true), size_);
+    }
+
+    template <class Key>
+    bool in_range(const K& key, const Key& lo, const Key& hi, bounds_t bounds) const
+    {
+        const auto& comp = compare_base::key_comp();
+        bool above_lo = (bounds & INCLUDE_LOWER) ? !comp(key, lo) : comp(lo, key);
+        bool below_hi = (bounds & INCLUDE_UPPER) ? !comp(hi, key) : comp(key, hi);
+        return above_lo && below_hi;
+    }
+
+    // cuts the tree at lo and at hi and joins back the outer parts, with
+    // the elements found at lo and hi when they lie outside the range
+    template <class Key>
+    immutable_map erase_range_imp(const Key& lo, const Key& hi, bounds_t bounds) const
+    {
+        auto first = bound_imp(lo, (bounds & INCLUDE_LOWER) == 0);
+        if (first == end() || !in_range(first->first, lo, hi, bounds)) return *this;
+        const node* lo_match = nullptr;
+        const node* hi_match = nullptr;
+        auto outer = split_subtree(root_.get(), subtree(root_).height_, lo, lo_match);
+        auto inner = split_subtree(outer.second.root_.get(), outer.second.height_, hi, hi_match);
+        auto erased = count_nodes(inner.first.root_.get());
+        bool keep_lo = lo_match && !in_range(lo_match->get_key(), lo, hi, bounds);
+        bool keep_hi = hi_match && !in_range(hi_match->get_key(), lo, hi, bounds);
+        erased += (lo_match && !keep_lo) + (hi_match && !keep_hi);
+        auto right = std::move(inner.second);
+        if (keep_hi) right = join_imp(subtree(), hi_match->kvp_, std::move(right));
+        auto result = keep_lo
+            ? join_imp(std::move(outer.first), lo_match->kvp_, std::move(right))
+            : join_imp(std::move(outer.first), std::move(right));
+        return immutable_map(*this, blacken(std::move(result)).root_, size_ - erased);
+    }
+
+    // erased counts the elements dropped from the subtree
+    template <class Pred>
+    subtree erase_if_imp(const subtree& t, Pred& pred, size_t& erased) const
+    {
+        auto n = t.root_.get();
+        if (!n) return t;
+        auto before = erased;
+        auto child_height = t.height_ - n->is_black();
+        auto left = erase_if_imp(subtree(n->get_child(LEFT), child_height), pred, erased);
+        bool keep = !pred(n->get_pair());
+        auto right = erase_if_imp(subtree(n->get_child(RIGHT), child_height), pred, erased);
+        if (keep && erased == before) return t;
+        if (keep) return join_imp(std::move(left), n->kvp_, std::move(right));
+        ++erased;
+        return join_imp(std::move(left), std::move(right));
+    }
+
+    // splits the subtree of n, of black height height, around key; match
+    // receives the node with an equivalent key, if any
+    template <class Key>
+    std::pair<subtree, subtree> split_subtree(const node* n, int height, const Key& key, const node*& match) const
+    {
+        if (!n) return std::pair<subtree, subtree>();
+        const auto& comp = compare_base::key_comp();
+        auto child_height = height - n->is_black();
+        subtree left(n->get_child(LEFT), child_height);
+        subtree right(n->get_child(RIGHT), child_height);
+        if (comp(key, n->get_key()))
+        {
+            auto parts = split_subtree(left.root_.get(), child_height, key, match);
+            parts.second = join_imp(std::move(parts.second), n->kvp_, std::move(right));
+            return parts;
+        }
+        if (comp(n->get_key(), key))
+        {
+            auto parts = split_subtree(right.root_.get(), child_height, key, match);
+            parts.first = join_imp(std::move(left), n->kvp_, std::move(parts.first));
+            return parts;
+        }
+        match = n;
+        return std::make_pair(std::move(left), std::move(right));
+    }
+
+    template <class Key>
+    std::tuple<immutable_map, const_iterator, immutable_map> split_imp(const Key& key) const
+    {
+        const node* match = nullptr;
+        auto parts = split_subtree(root_.get(), subtree(root_).height_, key, match);
+        immutable_map less(*this, blacken(std::move(parts.first)).root_, 0);
+        immutable_map greater(*this, blacken(std::move(parts.second)).root_, 0);
+        auto total = size_ - (match ? 1 : 0);
+        if constexpr (OrderStatistics)
+        {
+            less.size_ = subtree_size(less.root_.get());
+        }
+        else
+        {
+            // count both parts in lockstep until the smaller one runs out
+            auto a = less.begin();
+            auto b = greater.begin();
+            size_t count = 0;
+            while (a != less.end() && b != greater.end()) ++a, ++b, ++count;
+            less.size_ = a == less.end() ? count : total - count;
+        }
+        greater.size_ = total - less.size_;
+        return std::make_tuple(std::move(less), match ? find_imp(key) : end(), std::move(greater));
+    }
+
+    // the elements of a tree in key order, where subtrees stay unopened until
+    // the walk needs to look inside them. Every unopened subtree lies just
+    // above the element that follows it, which bounds its keys from above
+    class diff_cursor
+    {
+    public:
+        explicit diff_cursor(const node* root)
+          : size_(0)
+        {
+            if (root) push(root, false);
+        }
+
+        bool empty() const { return size_ == 0; }
+        const node* top() const { return items_[size_ - 1].node_; }
+        bool is_element() const { return items_[size_ - 1].element_; }
+        const node* bound() const { return size_ > 1 ? items_[size_ - 2].node_ : nullptr; }
+        void pop() { --size_; }
+
+        void expand()
+        {
+            auto n = top();
+            pop();
+            if (n->get_child(RIGHT)) push(n->get_child(RIGHT).get(), false);
+            push(n, true);
+            if (n->get_child(LEFT)) push(n->get_child(LEFT).get(), false);
+        }
+
+        template <class Function>
+        void drain(Function& f)
+        {
+            for (; size_ > 0; --size_)
+            {
+                if (is_element()) f(top()->get_pair());
+                else top()->foreach(f);
+            }
+        }
+
+    private:
+        struct item
+        {
+            const node* node_;
+            bool element_;
+        };
+
+        void push(const node* n, bool element)
+        {
+            items_[size_++] = item{ n, element };
+        }
+
+        std::array<item, sizeof(size_t) * 48> items_;
+        size_t size_;
+    };
+
+    // whether the key of element comes before every key under n
+    bool precedes(const node* element, const node* n) const
+    {
+        const auto& comp = compare_base::key_comp();
+        if (!comp(element->get_key(), n->get_key())) return false;
+        while (n->get_child(LEFT)) n = n->get_child(LEFT).get();
+        return comp(element->get_key(), n->get_key());
+    }
+
+    // below this black height (at least 2^10 - 1 elements) a set operation
+    // does not fork any more
+    static constexpr int parallel_height = 10;
+
+    // levels of recursion that may fork, enough to occupy every core
+    static int fork_levels(execution_t execution)
+    {
+        if (execution != PARALLEL || !std::is_empty<Allocator>::value) return 0;
+        int levels = 0;
+        for (auto n = std::thread::hardware_concurrency(); n > 1; n = (n + 1) / 2) ++levels;
+        return levels;
+    }
+
+    // runs f and g, on two threads when a fork is allowed
+    template <class F, class G>
+    static void fork_join(bool allowed, F f, G g)
+    {
+        if constexpr (ThreadingPolicy::is_thread_safe)
+        {
+            if (allowed)
+            {
+                auto done = std::async(std::launch::async, f);
+                g();
+                done.get();
+                return;
+            }
+        }
+        f();
+        g();
+    }
+
+    static size_t count_nodes(const node* n)
+    {
+        if constexpr (OrderStatistics) return subtree_size(n);
+        return n ? 1 + count_nodes(n->get_child(LEFT).get()) + count_nodes(n->get_child(RIGHT).get()) : 0;
+    }
+
+    // the memory held by the subtree of n that other does not share: looking
+    // a key up in other reaches the node holding it, so a shared subtree is
+    // recognized at its root and skipped whole, and a shared pair box by its
+    // address. Each unshared node costs a lookup, so a map that is e edits
+    // away from other takes O(e log^2 n)
+    static size_t unshared_bytes(const node* n, const immutable_map& other)
+    {
+        if (!n) return 0;
+        auto match = other.find_node(n->get_key());
+        if (match == n) return 0;
+        size_t bytes = sizeof(node);
+        if constexpr (!is_pair_inline)
+        {
+            if (!match || &match->get_pair() != &n->get_pair()) bytes += shared_pair::box_size();
+        }
+        return bytes + unshared_bytes(n->get_child(LEFT).get(), other) + unshared_bytes(n->get_child(RIGHT).get(), other);
+    }
+
+    // the memory held per element, in its node and pair box
+    static size_t element_bytes()
+    {
+        if constexpr (is_pair_inline) return sizeof(node);
+        return sizeof(node) + shared_pair::box_size();
+    }
+
+    // common counts the keys found in both subtrees
+    template <class Merge>
+    subtree union_imp(subtree a, subtree b, Merge& merge, size_t& common, int forks) const
+    {
+        if (!a.root_) return b;
+        if (!b.root_) return a;
+        auto n = a.root_.get();
+        if (n == b.root_.get())
+        {
+            common += count_nodes(n);
+            return a;
+        }
+        const node* match = nullptr;
+        auto parts = split_subtree(b.root_.get(), b.height_, n->get_key(), match);
+        auto child_height = a.height_ - n->is_black();
+        subtree left, right;
+        size_t left_common = 0, right_common = 0;
+        fork_join(forks > 0 && a.height_ >= parallel_height,
+            [&] { left = union_imp(subtree(n->get_child(LEFT), child_height), std::move(parts.first), merge, left_common, forks - 1); },
+            [&] { right = union_imp(subtree(n->get_child(RIGHT), child_height), std::move(parts.second), merge, right_common, forks - 1); });
+        common += left_common + right_common;
+        if (!match) return join_imp(std::move(left), n->kvp_, std::move(right));
+        ++common;
+        pair_storage kvp(get_allocator(), n->get_key(), merge(n->get_pair().second, match->get_pair().second));
+        return join_imp(std::move(left), kvp, std::move(right));
+    }
+
+    template <class Merge>
+    subtree intersection_imp(subtree a, subtree b, Merge& merge, size_t& common, int forks) const
+    {
+        if (!a.root_ || !b.root_) return subtree();
+        auto n = a.root_.get();
+        if (n == b.root_.get())
+        {
+            common += count_nodes(n);
+            return a;
+        }
+        const node* match = nullptr;
+        auto parts = split_subtree(b.root_.get(), b.height_, n->get_key(), match);
+        auto child_height = a.height_ - n->is_black();
+        subtree left, right;
+        size_t left_common = 0, right_common = 0;
+        fork_join(forks > 0 && a.height_ >= parallel_height,
+            [&] { left = intersection_imp(subtree(n->get_child(LEFT), child_height), std::move(parts.first), merge, left_common, forks - 1); },
+            [&] { right = intersection_imp(subtree(n->get_child(RIGHT), child_height), std::move(parts.second), merge, right_common, forks - 1); });
+        common += left_common + right_common;
+        if (!match) return join_imp(std::move(left), std::move(right));
+        ++common;
+        pair_storage kvp(get_allocator(), n->get_key(), merge(n->get_pair().second, match->get_pair().second));
+        return join_imp(std::move(left), kvp, std::move(right));
+    }
+
+    subtree difference_imp(subtree a, subtree b, size_t& common, int forks) const
+    {
+        if (!a.root_) return subtree();
+        if (!b.root_) return a;
+        auto n = a.root_.get();
+        if (n == b.root_.get())
+        {
+            common += count_nodes(n);
+            return subtree();
+        }
+        const node* match = nullptr;
+        auto parts = split_subtree(b.root_.get(), b.height_, n->get_key(), match);
+        auto child_height = a.height_ - n->is_black();
+        subtree left, right;
+        size_t left_common = 0, right_common = 0;
+        fork_join(forks > 0 && a.height_ >= parallel_height,
+            [&] { left = difference_imp(subtree(n->get_child(LEFT), child_height), std::move(parts.first), left_common, forks - 1); },
+            [&] { right = difference_imp(subtree(n->get_child(RIGHT), child_height), std::move(parts.second), right_common, forks - 1); });
+        common += left_common + right_common;
+        if (!match) return join_imp(std::move(left), n->kvp_, std::move(right));
+        ++common;
+        return join_imp(std::move(left), std::move(right));
+    }
+
+    // advances it past a run of equivalent keys and returns the last of them
+    template <class ForwardIt>
+    static ForwardIt next_unique(ForwardIt& it, ForwardIt last, const Compare& comp)
+    {
+        auto current = it;
+        while (++it != last)
+        {
+            if (comp((*it).first, (*current).first))
+                throw std::invalid_argument("range is not sorted");
+            if (comp((*current).first, (*it).first)) break;
+            current = it;
+        }
+        return current;
+    }
+
+    // builds a balanced tree of size elements; every nil position is at most one
+    // level apart, so colouring the nodes of the deepest level red (except a
+    // lone root) keeps all black heights equal
+    template <class ForwardIt>
+    node_ptr build_sorted(ForwardIt& it, ForwardIt last, size_t size, size_t depth, size_t red_depth) const
+    {
+        if (size == 0) return nullptr;
+        auto left = build_sorted(it, last, (size - 1) / 2, depth + 1, red_depth);
+        auto element = next_unique(it, last, compare_base::key_comp());
+        auto color = depth == red_depth && depth > 0 ? RED : BLACK;
+        node_ptr result(create<node>(get_allocator(), pair_storage(get_allocator(), *element), std::move(left), nullptr, color));
+        result->set_child(RIGHT, build_sorted(it, last, size / 2, depth + 1, red_depth));
+        return result;
+    }
+
+    immutable_map insert_imp(pair_storage&& kvp) const
+    {
+        path p;
+        auto match = find(p, kvp.get().first);
+        auto new_root = insert_imp(std::move(kvp), p, match);
+        return immutable_map(*this, std::move(new_root), match ? size_ : size_ + 1);
+    }
+
+    void insert_in_place(pair_storage&& kvp)
+    {
+        path p(true);
+        auto match = find(p, kvp.get().first);
+        root_ = insert_imp(std::move(kvp), p, match);
+        if (!match) ++size_;
+    }
+
+    node_ptr insert_imp(pair_storage&& kvp, path& p, bool match) const
+    {
+        if (match)
+        {
+            auto new_node = make_mutable(p.get_node(), p.is_editable());
+            new_node->set_pair(std::move(kvp));
+            p.pop();
+            return clone_path(p, new_node);
+        }
+        auto n = node_ptr(create<node>(get_allocator(), std::move(kvp), nullptr, nullptr, RED));
+        return insert_fix(p, n);
+    }
+
+    // an editable node is only reachable through the nodes being rebuilt, so
+    // it is reused as is; any other node is copied
+    static node_ptr make_mutable(const node* n, bool editable)
+    {
+        if (editable) return node_ptr(const_cast<node*>(n));
+        return n->clone();
+    }
+
+    // keys are compared once per level: the descent keeps the last node not
+    // less than the key and checks it for equivalence at the bottom
+    template <class Key>
+    const node* find_node(const Key& key) const
+    {
+        if constexpr (use_three_way<Key>)
+        {
+            auto node = root_.get();
+            while (node)
+            {
+                auto c = compare_three_way(key, node->get_key());
+                if (c == 0) return node;
+                node = node->get_child(c < 0 ? LEFT : RIGHT).get();
+            }
+            return nullptr;
+        }
+        const auto& comp = compare_base::key_comp();
+        const node* candidate = nullptr;
+        auto node = root_.get();
+        while (node)
+        {
+            if (comp(node->get_key(), key))
+            {
+                node = node->get_child(RIGHT).get();
+            }
+            else
+            {
+                candidate = node;
+                node = node->get_child(LEFT).get();
+            }
+        }
+        if (candidate && !comp(key, candidate->get_key())) return candidate;
+        return nullptr;
+    }
+
+    // on a match the matching node is left on top of the path, otherwise the
+    // path ends at the parent of the position where key would be inserted
+    template <class Key>
+    bool find(path& p, const Key& key) const
+    {
+        if constexpr (use_three_way<Key>)
+        {
+            auto node = root_.get();
+            while (node)
+            {
+                auto c = compare_three_way(key, node->get_key());
+                if (c == 0)
+                {
+                    p.push(node, LEFT);
+                    return true;
+                }
+                auto side = c < 0 ? LEFT : RIGHT;
+                p.push(node, side);
+                node = node->get_child(side).get();
+            }
+            return false;
+        }
+        const auto& comp = compare_base::key_comp();
+        size_t candidate = 0;
+        auto node = root_.get();
+        while (node)
+        {
+            if (comp(node->get_key(), key))
+            {
+                p.push(node, RIGHT);
+                node = node->get_child(RIGHT).get();
+            }
+            else
+            {
+                p.push(node, LEFT);
+                candidate = p.size();
+                node = node->get_child(LEFT).get();
+            }
+        }
+        if (candidate && !comp(key, p[candidate - 1]->get_key()))
+        {
+            p.truncate(candidate);
+            return true;
+        }
+        return false;
+    }
+
+    // precondition: path is not empty
+    node_ptr insert_fix(path& p, node_ptr n) const
+    {
+        if (p.empty())
+        {
+            n->set_color(BLACK);  
+            return n;
+        }
+        auto parent = p.get_node();
+        if (parent->is_black())
+        {
+            return clone_path(p, n);
+        }
+        else
+        {
+            auto parent_side = p.get_parent_side();
+            auto node_side = p.get_side();
+            auto new_parent = make_mutable(parent, p.is_editable());
+            auto new_grand_parent = make_mutable(p.get_parent(), p.is_parent_editable());
+            auto uncle = new_grand_parent->get_child(1 - parent_side).get();
+            if (uncle && uncle->is_red())
+            {
+                new_parent->set_color(BLACK);
+                new_parent->set_child(node_side, n);
+                auto new_uncle = make_mutable(uncle, uncle->is_unique());
+                new_uncle->set_color(BLACK);
+                new_grand_parent->set_color(RED);
+                new_grand_parent->set_child(parent_side, new_parent);
+                new_grand_parent->set_child(1 - parent_side, new_uncle);
+                p.pop(); p.pop();
+                return insert_fix(p, new_grand_parent);
+            }
+            else
+            {
+                if (parent_side != node_side)
+                {
+                    new_parent->set_child(node_side, n->get_child(parent_side));
+                    new_grand_parent->set_child(parent_side, n->get_child(node_side));
+                    new_grand_parent->set_color(RED);
+                    n->set_child(parent_side, new_parent),
+                    n->set_child(node_side, new_grand_parent);
+                    n->set_color(BLACK);
+                    p.pop(); p.pop();
+                    return clone_path(p, n);
+                }
+                else
+                {
+                    new_grand_parent->set_child(parent_side, new_parent->get_child(1 - parent_side));
+                    new_grand_parent->set_color(RED);
+                    new_parent->set_child(1 - parent_side, new_grand_parent);
+                    new_parent->set_child(parent_side, n);
+                    new_parent->set_color(BLACK);
+                    p.pop(); p.pop();
+                    return clone_path(p, new_parent);
+                }
+            }
+        }
+    }
+
+    node_ptr clone_path(path& p, node_ptr n) const
+    {
+        return clone_path(p, std::move(n), 0);
+    }
+
+    // n (possibly null) replaces the child on the path below the top node
+    node_ptr clone_path(path& p, node_ptr n, size_t depth) const
+    {
+        while (p.size() > depth)
+        {
+            // an editable node already pointing at n is kept together with
+            // everything above it, unless nodes summarize their subtrees
+            if (!OrderStatistics && !has_aggregate && p.is_editable() && p.get_node()->get_child(p.get_side()).get() == n.get())
+            {
+                auto top = p[depth];
+                p.truncate(depth);
+                return make_mutable(top, true);
+            }
+            auto new_parent = make_mutable(p.get_node(), p.is_editable());
+            new_parent->set_child(p.get_side(), std::move(n));
+            n = std::move(new_parent);
+            p.pop();
+        }
+        return n;
+    }
+
+    void find_predecessor(path& p) const
+    {
+        p.set_side(LEFT);
+        auto node = p.get_node()->get_child(LEFT).get();
+        while (node)
+        {
+            p.push(node, RIGHT);
+            node = node->get_child(RIGHT).get();
+        }
+    }
+
+    node_ptr erase_imp(path& p) const
+    {
+        auto n = p.get_node();
+        bool has_left_child = (bool)n->get_child(LEFT);
+        bool has_right_child = (bool)n->get_child(RIGHT);
+        if (has_left_child && has_right_child)
+        {
+            return erase_intermediate_node(p);
+        }
+        else if (has_left_child || has_right_child)
+        {
+            auto child = n->get_child(has_left_child ? LEFT : RIGHT).get();
+            auto new_child = make_mutable(child, p.is_editable() && child->is_unique());
+            new_child->set_color(BLACK);
+            p.pop();
+            return clone_path(p, new_child);
+        }
+        else if (n->is_red())
+        {
+            auto parent_side = p.get_parent_side();
+            auto new_parent = make_mutable(p.get_parent(), p.is_parent_editable());
+            new_parent->set_child(parent_side, nullptr);
+            p.pop(); p.pop();
+            return clone_path(p, new_parent);
+        }
+        else if (p.size() == 1) // deleting root
+        {
+            return nullptr;
+        }
+        else
+        {
+            auto parent_side = p.get_parent_side();
+            auto new_parent = make_mutable(p.get_parent(), p.is_parent_editable());
+            new_parent->set_child(parent_side, nullptr);
+            p.pop(); p.pop();
+            return delete_fixup(p, new_parent, parent_side);
+        }
+    }
+
+    node_ptr erase_intermediate_node(path& p) const
+    {
+        auto erased_node = p.get_node();
+        auto node_color = erased_node->get_color();
+        auto depth = p.size();
+        find_predecessor(p); // predecessor has no right child
+        auto predecessor = p.get_node();
+        auto predecessor_depth = p.size();
+        auto predecessor_side = (predecessor_depth - depth) > 1 ? RIGHT : LEFT;
+        auto predecessor_color = predecessor->get_color();
+        auto new_node = make_mutable(predecessor, p.is_editable());
+        new_node->set_color(node_color);
+        if (predecessor_color == RED) // removed node is red
+        {
+            p.pop();
+            auto sub_tree = clone_path(p, nullptr, depth);
+            new_node->set_child(LEFT, sub_tree);
+            new_node->set_child(RIGHT, erased_node->get_child(RIGHT));
+            p.pop();
+            return clone_path(p, new_node);
+        }
+        else
+        {
+            if (predecessor->get_child(LEFT)) // removed node has a left-child red
+            {
+                auto child = predecessor->get_child(LEFT).get();
+                auto new_child = make_mutable(child, p.is_editable() && child->is_unique());
+                new_child->set_color(BLACK);
+                p.pop();
+                auto sub_tree = clone_path(p, new_child, depth);
+                new_node->set_child(LEFT, sub_tree);
+                new_node->set_child(RIGHT, erased_node->get_child(RIGHT));
+                p.pop();
+                return clone_path(p, new_node);
+            }
+            else // removed node is black with no children
+            {
+                p.pop();
+                auto sub_tree = clone_path(p, nullptr, depth);
+                new_node->set_child(LEFT, sub_tree);
+                new_node->set_child(RIGHT, erased_node->get_child(RIGHT));
+                p.pop();
+                auto temp_root = clone_path(p, new_node);
+                p.retrace(temp_root.get(), predecessor_depth - 1);
+                auto new_parent = make_mutable(p.get_node(), p.is_editable());
+                p.pop();
+                return delete_fixup(p, new_parent, predecessor_side);
+            }
+        }
+    }
+
+    // parent belongs to the tree being rebuilt; its children are editable
+    // when nothing else refers to them
+    node_ptr delete_fixup(path& p, node_ptr parent, int side) const
+    {
+        if (has_black_sibling_with_red_child(parent.get(), side))
+        {
+            auto new_parent = delete_fixup_1(std::move(parent), side);
+            return clone_path(p, new_parent);
+        }
+        else if (has_black_sibling_with_black_children(parent.get(), side))
+        {
+            auto parent_color = parent->get_color();
+            auto new_parent = delete_fixup_2(std::move(parent), side);
+            if (parent_color == BLACK && p.size() > 0) // parent is black and not root
+            {
+                auto parent_side = p.get_side();
+                auto new_grand_parent = make_mutable(p.get_node(), p.is_editable());
+                new_grand_parent->set_child(parent_side, new_parent);
+                p.pop();
+                return delete_fixup(p, new_grand_parent, parent_side);
+            }
+            else
+            {
+                return clone_path(p, new_parent);
+            }
+        }
+        else
+        {
+            auto new_parent = delete_fixup_3(std::move(parent), side);
+            return clone_path(p, new_parent);
+        }
+    }
+
+    node_ptr delete_fixup_1(node_ptr parent, int side) const
+    {
+        auto parent_color = parent->get_color();
+        auto sibling = parent->get_child(1 - side).get();
+        auto new_sibling = make_mutable(sibling, sibling->is_unique());
+        auto child_1 = new_sibling->get_child(side).get();
+        if (child_1 && child_1->is_red())
+        {
+            auto new_child_1 = make_mutable(child_1, child_1->is_unique());
+            parent->set_color(BLACK);
+            parent->set_child(1 - side, new_child_1->get_child(side));
+            new_sibling->set_child(side, new_child_1->get_child(1 - side));
+            new_child_1->set_color(parent_color);
+            new_child_1->set_child(side, parent);
+            new_child_1->set_child(1 - side, new_sibling);
+            return new_child_1;
+        }
+        else
+        {
+            auto child_2 = new_sibling->get_child(1 - side).get();
+            auto new_child_2 = make_mutable(child_2, child_2->is_unique());
+            parent->set_color(BLACK);
+            parent->set_child(1 - side, new_sibling->get_child(side));
+            new_child_2->set_color(BLACK);
+            new_sibling->set_color(parent_color);
+            new_sibling->set_child(side, parent);
+            new_sibling->set_child(1 - side, new_child_2);
+            return new_sibling;
+        }
+    }
+
+    node_ptr delete_fixup_2(node_ptr parent, int side)  const // recoloring
+    {
+        auto sibling = parent->get_child(1 - side).get();
+        auto new_sibling = make_mutable(sibling, sibling->is_unique());
+        new_sibling->set_color(RED);
+        parent->set_color(BLACK);
+        parent->set_child(1 - side, new_sibling);
+        return parent;
+    }
+
+    node_ptr delete_fixup_3(node_ptr parent, int side)  const // adjustment
+    {
+        auto parent_color = parent->get_color();
+        auto sibling = parent->get_child(1 - side).get();
+        auto new_sibling = make_mutable(sibling, sibling->is_unique());
+        parent->set_color(RED);
+        parent->set_child(1 - side, new_sibling->get_child(side));
+        new_sibling->set_child(side, nullptr); // leaves parent the only owner
+        if (has_black_sibling_with_red_child(parent.get(), side))
+        {
+            parent = delete_fixup_1(std::move(parent), side);
+        }
+        else if (has_black_sibling_with_black_children(parent.get(), side))
+        {
+            parent = delete_fixup_2(std::move(parent), side);
+        }
+        new_sibling->set_color(parent_color);
+        new_sibling->set_child(side, parent);
+        return new_sibling;
+    }
+
+    bool has_black_sibling_with_red_child(const node* parent, int side) const
+    {
+        auto sibling = parent->get_child(1 - side);
+        if (sibling->is_red()) return false;
+        return sibling->has_red_child();
+    }
+
+    bool has_black_sibling_with_black_children(const node* parent, int side) const
+    {
+        auto sibling = parent->get_child(1 - side);
+        if (sibling->is_red()) return false;
+        return !sibling->has_red_child();
+    }
+
+    bool has_red_sibling(const node* parent, int side) const
+    {
+        auto sibling = parent->get_child(1 - side);
+        return sibling && sibling->is_red();
+    }
+
+public:
+    // keeps the path from the root to the current node in a bounded stack of
+    // borrowed pointers; an empty stack is the end position
+    class const_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef pair value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const pair* pointer;
+        typedef const pair& reference;
+
+        const_iterator()
+          : root_(nullptr),
+            size_(0)
+        {}
+
+        reference operator * () const { return stack_[size_ - 1]->get_pair(); }
+        pointer operator -> () const { return &stack_[size_ - 1]->get_pair(); }
+
+        const_iterator& operator ++ ()
+        {
+            auto node = stack_[size_ - 1];
+            if (node->get_child(RIGHT))
+            {
+                push_leftmost(node->get_child(RIGHT).get());
+                return *this;
+            }
+            // climb while coming from a right child
+            while (--size_ > 0 && stack_[size_ - 1]->get_child(RIGHT).get() == node)
+                node = stack_[size_ - 1];
+            return *this;
+        }
+
+        const_iterator& operator -- ()
+        {
+            if (size_ == 0)
+            {
+                push_rightmost(root_);
+                return *this;
+            }
+            auto node = stack_[size_ - 1];
+            if (node->get_child(LEFT))
+            {
+                push_rightmost(node->get_child(LEFT).get());
+                return *this;
+            }
+            while (--size_ > 0 && stack_[size_ - 1]->get_child(LEFT).get() == node)
+                node = stack_[size_ - 1];
+            return *this;
+        }
+
+        const_iterator operator ++ (int)
+        {
+            auto it = *this;
+            ++*this;
+            return it;
+        }
+
+        const_iterator operator -- (int)
+        {
+            auto it = *this;
+            --*this;
+            return it;
+        }
+
+        bool operator == (const const_iterator& other) const
+        {
+            return get_node() == other.get_node();
+        }
+
+        bool operator != (const const_iterator& other) const
+        {
+            return get_node() != other.get_node();
+        }
+
+    private:
+        friend class immutable_map;
+        friend class const_reverse_iterator;
+
+        explicit const_iterator(const node* root)
+          : root_(root),
+            size_(0)
+        {}
+
+        const node* get_node() const
+        {
+            return size_ > 0 ? stack_[size_ - 1] : nullptr;
+        }
+
+        void push_leftmost(const node* node)
+        {
+            for (; node; node = node->get_child(LEFT).get()) stack_[size_++] = node;
+        }
+
+        void push_rightmost(const node* node)
+        {
+            for (; node; node = node->get_child(RIGHT).get()) stack_[size_++] = node;
+        }
+
+        const node* root_;
+        std::array<const node*, sizeof(size_t) * 16> stack_;
+        size_t size_;
+    };
+
+    // steps a const_iterator in place, pointing at the element itself rather
+    // than one past it as std::reverse_iterator does, which would copy the
+    // whole stack and step it again on every dereference. Like
+    // std::reverse_iterator, it is built from the position after the first
+    // element it visits, and base() returns that position
+    class const_reverse_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef pair value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const pair* pointer;
+        typedef const pair& reference;
+
+        const_reverse_iterator() {}
+
+        explicit const_reverse_iterator(const_iterator it)
+          : current_(std::move(it))
+        {
+            --current_;
+        }
+
+        const_iterator base() const
+        {
+            auto it = current_;
+            if (it.size_ == 0)
+                it.push_leftmost(it.root_);
+            else
+                ++it;
+            return it;
+        }
+
+        reference operator * () const { return *current_; }
+        pointer operator -> () const { return current_.operator -> (); }
+
+        const_reverse_iterator& operator ++ ()
+        {
+            --current_;
+            return *this;
+        }
+
+        const_reverse_iterator& operator -- ()
+        {
+            if (current_.size_ == 0)
+                current_.push_leftmost(current_.root_);
+            else
+                ++current_;
+            return *this;
+        }
+
+        const_reverse_iterator operator ++ (int)
+        {
+            auto it = *this;
+            ++*this;
+            return it;
+        }
+
+        const_reverse_iterator operator -- (int)
+        {
+            auto it = *this;
+            --*this;
+            return it;
+        }
+
+        bool operator == (const const_reverse_iterator& other) const
+        {
+            return current_ == other.current_;
+        }
+
+        bool operator != (const const_reverse_iterator& other) const
+        {
+            return current_ != other.current_;
+        }
+
+    private:
+        friend class immutable_map;
+
+        struct at_tag {};
+
+        const_reverse_iterator(const_iterator it, at_tag)
+          : current_(std::move(it))
+        {}
+
+        static const_reverse_iterator at(const_iterator it)
+        {
+            return const_reverse_iterator(std::move(it), at_tag());
+        }
+
+        const_iterator current_;
+    };
+
+    // collects a batch of edits: nodes that only the transient can reach,
+    // i.e. those it has already copied, are modified in place instead of being
+    // copied again, so a run of edits copies each node at most once.
+    // persistent() hands the result over as a map in O(1) and leaves the
+    // transient empty. A transient must not be shared between threads, but
+    // the maps it started from or handed over can, as their nodes are never
+    // modified; iterators into a map moved into a transient are invalidated
+    class transient
+    {
+    public:
+        explicit transient(immutable_map map)
+          : map_(std::move(map))
+        {}
+
+        transient& insert(const pair& kvp)
+        {
+            map_.insert_in_place(pair_storage(map_.get_allocator(), kvp));
+            return *this;
+        }
+
+        transient& insert(pair&& kvp)
+        {
+            map_.insert_in_place(pair_storage(map_.get_allocator(), std::move(kvp)));
+            return *this;
+        }
+
+        transient& erase(const K& key)
+        {
+            map_.erase_in_place(key);
+            return *this;
+        }
+
+        template <class Key, class C = Compare, class = typename C::is_transparent>
+        transient& erase(const Key& key)
+        {
+            map_.erase_in_place(key);
+            return *this;
+        }
+
+        const T& at(const K& key) const
+        {
+            return map_.at(key);
+        }
+
+        template <class Key, class C = Compare, class = typename C::is_transparent>
+        const T& at(const Key& key) const
+        {
+            return map_.at(key);
+        }
+
+        bool contains(const K& key) const
+        {
+            return map_.contains(key);
+        }
+
+        template <class Key, class C = Compare, class = typename C::is_transparent>
+        bool contains(const Key& key) const
+        {
+            return map_.contains(key);
+        }
+
+        bool empty() const
+        {
+            return map_.empty();
+        }
+
+        size_t size() const
+        {
+            return map_.size();
+        }
+
+        immutable_map persistent()
+        {
+            return std::move(map_);
+        }
+
+    private:
+        immutable_map map_;
+    };
+
+    // frees dropped versions away from the threads that drop them: retire()
+    // takes a map over in O(1), and each drain() step visits at most a given
+    // number of nodes, freeing those that no live version shares. start()
+    // runs the steps on a background thread until stop(); the destructor
+    // frees whatever is left
+    class reclaimer
+    {
+    public:
+        reclaimer()
+          : pending_work_(false),
+            stopping_(false)
+        {}
+
+        reclaimer(const reclaimer&) = delete;
+        void operator = (const reclaimer&) = delete;
+
+        ~reclaimer()
+        {
+            stop();
+            drain(size_t(-1));
+        }
+
+        void retire(immutable_map map)
+        {
+            auto root = map.root_.detach();
+            if (!root) return;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                retired_.push_back(root);
+            }
+            wake_.notify_one();
+        }
+
+        // returns the number of nodes freed
+        size_t drain(size_t max_nodes)
+        {
+            std::lock_guard<std::mutex> drain_lock(drain_mutex_);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                work_.insert(work_.end(), retired_.begin(), retired_.end());
+                retired_.clear();
+            }
+            size_t freed = 0;
+            std::array<const node*, 2> children;
+            for (size_t visited = 0; visited < max_nodes && !work_.empty(); ++visited)
+            {
+                auto n = work_.back();
+                work_.pop_back();
+                if (!n->release_shallow(children)) continue;
+                ++freed;
+                for (auto child : children)
+                {
+                    if (child) work_.push_back(child);
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_work_ = !work_.empty();
+            return freed;
+        }
+
+        bool empty() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return retired_.empty() && !pending_work_;
+        }
+
+        void start(size_t nodes_per_step = 4096)
+        {
+            static_assert(ThreadingPolicy::is_thread_safe, "a background reclaimer requires a thread-safe ThreadingPolicy");
+            stop();
+            stopping_ = false;
+            thread_ = std::thread([this, nodes_per_step]
+            {
+                for (;;)
+                {
+                    {
+                        std::unique_lock<std::mutex> lock(mutex_);
+                        wake_.wait(lock, [this] { return stopping_ || pending_work_ || !retired_.empty(); });
+                        if (stopping_) return;
+                    }
+                    drain(nodes_per_step);
+                    std::this_thread::yield();
+                }
+            });
+        }
+
+        void stop()
+        {
+            if (!thread_.joinable()) return;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            wake_.notify_one();
+            thread_.join();
+        }
+
+    private:
+        mutable std::mutex mutex_;
+        std::condition_variable wake_;
+        std::vector<const node*> retired_;
+        bool pending_work_;
+        bool stopping_;
+        // the nodes whose references are yet to be dropped, owned by drain()
+        std::mutex drain_mutex_;
+        std::vector<const node*> work_;
+        std::thread thread_;
+    };
+};
+
+// a cell holding the current version of a map, which threads read and replace
+// concurrently without locks; readers never wait for writers. The cell word
+// packs the address of a reference counted snapshot of the map with the number
+// of readers inside load(), and every published snapshot holds a reserve of
+// references, one per reader that may be announced in the word: a reader
+// borrows one while it copies the map, and a writer that replaces the
+// snapshot hands the borrowed ones over to their readers and drops the rest.
+// On 64-bit targets addresses must fit in 48 bits, and at most 65535 readers
+// may be inside load() at once. Replaced snapshots are freed by later writes,
+// once no reader pinned with pin() can still see them
+template <class Map>
+class atomic_immutable_map
+{
+public:
+    typedef Map map_type;
+    typedef typename Map::threading_policy threading_policy;
+    typedef typename Map::pair pair;
+    typedef typename pair::first_type key_type;
+
+    static_assert(threading_policy::is_thread_safe, "atomic_immutable_map requires a thread-safe ThreadingPolicy");
+
+    atomic_immutable_map()
+      : atomic_immutable_map(map_type())
+    {}
+
+    explicit atomic_immutable_map(map_type map)
+      : alloc_(map.get_allocator()),
+        word_(pack(create(std::move(map)))),
+        retired_(nullptr),
+        pending_(nullptr),
+        combining_(false)
+    {}
+
+    atomic_immutable_map(const atomic_immutable_map&) = delete;
+    void operator = (const atomic_immutable_map&) = delete;
+
+    ~atomic_immutable_map()
+    {
+        auto word = word_.load(std::memory_order_acquire);
+        release(pointer(word), unborrowed(word));
+        for (auto s = retired_.load(std::memory_order_acquire); s;)
+        {
+            auto next = s->next_;
+            release(s, s->unborrowed_);
+            s = next;
         }
-        return n;
     }
 
-    std::shared_ptr<node> clone_path(path& p, std::shared_ptr<node> n, size_t depth) const
+    // a version pinned without touching any reference count, so that readers
+    // on many cores do not contend for the cache lines of the counts. A guard
+    // must be destroyed by the thread that made it, and while it lives the
+    // versions replaced in any atomic map are not reclaimed
+    class read_guard
     {
-        while (p.size() > depth)
+    public:
+        read_guard(read_guard&& other)
+          : map_(other.map_)
         {
-            auto parent = p.get_node();
-            auto new_parent = parent->clone();
-            if (new_parent->get_key() > n->get_key())
-                new_parent->set_child(LEFT, n);
-            else
-                new_parent->set_child(RIGHT, n);
-            n = new_parent;
-            p.pop();
+            other.map_ = nullptr;
         }
-        return n;
+
+        read_guard(const read_guard&) = delete;
+        void operator = (const read_guard&) = delete;
+
+        ~read_guard()
+        {
+            if (map_) immutable_map_detail::epoch_domain::unpin();
+        }
+
+        const map_type& operator * () const { return *map_; }
+        const map_type* operator -> () const { return map_; }
+
+    private:
+        friend class atomic_immutable_map;
+
+        explicit read_guard(const map_type* map)
+          : map_(map)
+        {}
+
+        const map_type* map_;
+    };
+
+    read_guard pin() const
+    {
+        immutable_map_detail::epoch_domain::pin();
+        return read_guard(&pointer(word_.load(std::memory_order_acquire))->map_);
+    }
+
+    map_type load() const
+    {
+        auto word = announce();
+        map_type map(pointer(word)->map_);
+        withdraw(word);
+        return map;
+    }
+
+    void store(map_type map)
+    {
+        exchange(std::move(map));
+    }
+
+    map_type exchange(map_type map)
+    {
+        auto word = word_.exchange(pack(create(std::move(map))), std::memory_order_acq_rel);
+        map_type previous(pointer(word)->map_);
+        retire(word);
+        return previous;
     }
 
-    // precondition: depth > 0
-    std::shared_ptr<node> clone_path(path& p, std::shared_ptr<node> n, int side, size_t depth) const
+    // publishes desired if the cell still holds expected, i.e. the very same
+    // version rather than an equal one; otherwise loads the current version
+    // into expected and returns false
+    bool compare_exchange(map_type& expected, const map_type& desired)
     {
-        if (p.size() > depth)
+        auto word = announce();
+        snapshot* current = pointer(word);
+        threading_policy::increment(current->refs_);
+        withdraw(word);
+        if (current->map_.root_.get() == expected.root_.get())
         {
-            auto parent = p.get_node();
-            auto grand_parent = p.get_parent();
-            auto new_parent = parent->clone();
-            new_parent->set_child(side, n);
-            p.pop();
-            int parent_side = grand_parent->get_key() > parent->get_key() ? LEFT : RIGHT;
-            return clone_path(p, new_parent, parent_side, depth);
+            snapshot* next = create(desired);
+            word = word_.load(std::memory_order_relaxed);
+            while (pointer(word) == current)
+            {
+                if (word_.compare_exchange_weak(word, pack(next), std::memory_order_acq_rel, std::memory_order_relaxed))
+                {
+                    retire(word);
+                    release(current, 1);
+                    return true;
+                }
+            }
+            release(next, max_readers + 1);
         }
-        return n;
+        release(current, 1);
+        expected = load();
+        return false;
     }
 
-    void find_predecessor(path& p) const
+    // publishes fn(current) in a retry loop and returns the version published;
+    // fn must be a pure function of the map, as it may run several times. A
+    // result sharing the root of its argument is not published
+    template <class Function>
+    map_type swap(Function fn)
     {
-        auto node = p.get_node()->get_child(LEFT);
-        while (node)
+        map_type expected = load();
+        for (;;)
         {
-            p.push(node);
-            node = node->get_child(RIGHT);
+            map_type desired = fn(static_cast<const map_type&>(expected));
+            if (desired.root_.get() == expected.root_.get() || compare_exchange(expected, desired)) return desired;
         }
     }
 
-    std::shared_ptr<node> erase_imp(path& p) const
+    // edits through a combiner: the calling thread queues its edit, and the
+    // thread that takes the combiner role applies all the queued edits, sorted
+    // by key, to a transient of the current version and publishes the result
+    // with one compare_exchange. A batch copies each node it touches at most
+    // once, where contending swap() calls copy a path per edit and per lost
+    // race. The call returns once the edit is published
+    void insert(const pair& kvp)
     {
-        auto n = p.get_node();
-        bool has_left_child = (bool)n->get_child(LEFT);
-        bool has_right_child = (bool)n->get_child(RIGHT);
-        if (has_left_child && has_right_child)
+        request r(&kvp, kvp.first);
+        submit(r);
+    }
+
+    void erase(const key_type& key)
+    {
+        request r(nullptr, key);
+        submit(r);
+    }
+
+private:
+    // an edit waiting for a combiner, on the stack of the thread that made it
+    struct request
+    {
+        request(const pair* kvp, const key_type& key)
+          : kvp_(kvp),
+            key_(key),
+            next_(nullptr),
+            done_(false)
+        {}
+
+        const pair* kvp_; // null for an erase
+        const key_type& key_;
+        request* next_;
+        std::exception_ptr error_;
+        std::atomic<bool> done_;
+    };
+
+    void submit(request& r)
+    {
+        r.next_ = pending_.load(std::memory_order_relaxed);
+        while (!pending_.compare_exchange_weak(r.next_, &r, std::memory_order_release, std::memory_order_relaxed)) {}
+        while (!r.done_.load(std::memory_order_acquire))
         {
-            return erase_intermediate_node(p);
+            if (!combining_.exchange(true, std::memory_order_acquire))
+            {
+                combine();
+                combining_.store(false, std::memory_order_release);
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
         }
-        else if (has_left_child)
+        if (r.error_) std::rethrow_exception(r.error_);
+    }
+
+    void combine()
+    {
+        request* batch = nullptr;
+        for (auto r = pending_.exchange(nullptr, std::memory_order_acquire); r;)
         {
-            auto new_child = n->get_child(LEFT)->clone();
-            new_child->set_color(BLACK);
-            p.pop();
-            return clone_path(p, new_child);
+            auto next = r->next_;
+            r->next_ = batch;
+            batch = r;
+            r = next;
         }
-        else if (has_right_child)
+        if (!batch) return;
+        std::exception_ptr error;
+        try
         {
-            auto new_child = n->get_child(RIGHT)->clone();
-            new_child->set_color(BLACK);
-            p.pop();
-            return clone_path(p, new_child);
+            map_type expected = load();
+            batch = sort_by_key(batch, expected.key_comp());
+            for (;;)
+            {
+                auto t = expected.as_transient();
+                for (auto r = batch; r; r = r->next_)
+                {
+                    if (r->kvp_)
+                        t.insert(*r->kvp_);
+                    else
+                        t.erase(r->key_);
+                }
+                if (compare_exchange(expected, t.persistent())) break;
+            }
         }
-        else if (n->is_red())
+        catch (...)
         {
-            auto parent_side = p.get_parent()->get_key() > n->get_key() ? LEFT : RIGHT;
-            auto new_parent = p.get_parent()->clone();
-            new_parent->set_child(parent_side, nullptr);
-            p.pop(); p.pop();
-            return clone_path(p, new_parent);
+            error = std::current_exception();
         }
-        else if (p.size() == 1) // deleting root
+        // the owner may return as soon as its request is done
+        for (auto r = batch; r;)
         {
-            return nullptr;
+            auto next = r->next_;
+            r->error_ = error;
+            r->done_.store(true, std::memory_order_release);
+            r = next;
         }
-        else
+    }
+
+    // stable merge sort of a batch, so that edits to the same key keep the
+    // order they were queued in
+    template <class Compare>
+    static request* sort_by_key(request* list, const Compare& comp)
+    {
+        if (!list->next_) return list;
+        auto middle = list;
+        for (auto fast = list->next_; fast && fast->next_; fast = fast->next_->next_) middle = middle->next_;
+        auto right = sort_by_key(middle->next_, comp);
+        middle->next_ = nullptr;
+        auto left = sort_by_key(list, comp);
+        request* merged = nullptr;
+        request** tail = &merged;
+        while (left && right)
         {
-            auto parent_side = p.get_parent()->get_key() > n->get_key() ? LEFT : RIGHT;
-            auto new_parent = p.get_parent()->clone();
-            new_parent->set_child(parent_side, nullptr);
-            p.pop(); p.pop();
-            return delete_fixup(p, new_parent, parent_side);
+            auto& first = comp(right->key_, left->key_) ? right : left;
+            *tail = first;
+            tail = &first->next_;
+            first = first->next_;
         }
+        *tail = left ? left : right;
+        return merged;
     }
 
-    std::shared_ptr<node> erase_intermediate_node(path& p) const
+    // readers are counted in the bits above the address
+    static constexpr int reader_shift = sizeof(void*) == 8 ? 48 : 32;
+    static constexpr std::uint64_t reader = std::uint64_t(1) << reader_shift;
+    static constexpr unsigned int max_readers = 0xffff;
+
+    struct snapshot
     {
-        auto erased_node = p.get_node();
-        auto node_color = erased_node->get_color();
-        auto depth = p.size();
-        //auto kvp = erased_node->get_pair();
-        find_predecessor(p); // predecessor has no right child
-        auto predecessor = p.get_node();
-        auto predecessor_depth = p.size();
-        auto predecessor_side = (predecessor_depth - depth) > 1 ? RIGHT : LEFT;
-        auto predecessor_color = predecessor->get_color();
-        auto new_node = predecessor->clone();
-        new_node->set_color(node_color);
-        if (predecessor_color == RED) // removed node is red
+        explicit snapshot(map_type map)
+          : map_(std::move(map)),
+            refs_(max_readers + 1)
+        {}
+
+        map_type map_;
+        typename threading_policy::counter_type refs_;
+        // set when retired
+        snapshot* next_;
+        std::uint64_t epoch_;
+        unsigned int unborrowed_;
+    };
+
+    typedef typename std::allocator_traits<typename Map::allocator_type>::template rebind_alloc<snapshot> allocator_type;
+    typedef std::allocator_traits<allocator_type> traits;
+
+    static std::uint64_t pack(snapshot* s)
+    {
+        return static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(s));
+    }
+
+    static snapshot* pointer(std::uint64_t word)
+    {
+        return reinterpret_cast<snapshot*>(static_cast<std::uintptr_t>(word & (reader - 1)));
+    }
+
+    snapshot* create(map_type map) const
+    {
+        allocator_type a(alloc_);
+        snapshot* s = traits::allocate(a, 1);
+        try
         {
-            p.pop();
-            auto sub_tree = clone_path(p, nullptr, predecessor_side, depth);
-            new_node->set_child(LEFT, sub_tree);
-            new_node->set_child(RIGHT, erased_node->get_child(RIGHT));
-            p.pop();
-            return clone_path(p, new_node);
+            traits::construct(a, s, std::move(map));
         }
-        else
+        catch (...)
         {
-            if (predecessor->get_child(LEFT)) // removed node has a left-child red
-            {
-                auto new_child = predecessor->get_child(LEFT)->clone();
-                new_child->set_color(BLACK);
-                p.pop();
-                auto sub_tree = clone_path(p, new_child, depth);
-                new_node->set_child(LEFT, sub_tree);
-                new_node->set_child(RIGHT, erased_node->get_child(RIGHT));
-                p.pop();
-                return clone_path(p, new_node);
-            }
-            else // removed node is black with no children
-            {
-                p.pop();
-                auto kvp = predecessor_side == LEFT ? predecessor->get_pair() : p.get_node()->get_pair();
-                auto sub_tree = clone_path(p, nullptr, predecessor_side, depth);
-                new_node->set_child(LEFT, sub_tree);
-                new_node->set_child(RIGHT, erased_node->get_child(RIGHT));
-                p.pop();
-                auto temp_root = clone_path(p, new_node);
-                find(temp_root, p, kvp->first);
-                auto new_parent = p.get_node();
-                p.pop();
-                return delete_fixup(p, new_parent, predecessor_side);
-            }
+            traits::deallocate(a, s, 1);
+            throw;
         }
+        return s;
+    }
+
+    void release(snapshot* s, unsigned int count) const
+    {
+        if (!threading_policy::decrement(s->refs_, count)) return;
+        allocator_type a(alloc_);
+        traits::destroy(a, s);
+        traits::deallocate(a, s, 1);
     }
 
-    std::shared_ptr<node> delete_fixup(path& p, std::shared_ptr<const node> parent, int side) const
+    // borrows a reference from the reserve of the current snapshot
+    std::uint64_t announce() const
     {
-        if (has_black_sibling_with_red_child(parent, side))
+        return word_.fetch_add(reader, std::memory_order_acquire) + reader;
+    }
+
+    // gives the reference back to the reserve, or drops it if a writer has
+    // replaced the snapshot meanwhile and handed it over to the reader
+    void withdraw(std::uint64_t word) const
+    {
+        snapshot* current = pointer(word);
+        while (!word_.compare_exchange_weak(word, word - reader, std::memory_order_release, std::memory_order_relaxed))
         {
-            auto new_parent = delete_fixup_1(parent, side);
-            return clone_path(p, new_parent);
+            if (pointer(word) != current)
+            {
+                release(current, 1);
+                return;
+            }
         }
-        else if (has_black_sibling_with_black_children(parent, side))
+    }
+
+    // the reference of the cell to its snapshot, along with the part of the
+    // reserve that no reader has borrowed
+    static unsigned int unborrowed(std::uint64_t word)
+    {
+        return max_readers - static_cast<unsigned int>(word >> reader_shift) + 1;
+    }
+
+    // the cell no longer holds the snapshot, but pinned readers may
+    void retire(std::uint64_t word)
+    {
+        snapshot* previous = pointer(word);
+        previous->unborrowed_ = unborrowed(word);
+        previous->epoch_ = immutable_map_detail::epoch_domain::current();
+        previous->next_ = retired_.load(std::memory_order_relaxed);
+        while (!retired_.compare_exchange_weak(previous->next_, previous, std::memory_order_release, std::memory_order_relaxed)) {}
+        collect();
+    }
+
+    // frees the retired snapshots that no pinned reader can see, and puts the
+    // others back
+    void collect()
+    {
+        auto epoch = immutable_map_detail::epoch_domain::advance();
+        snapshot* kept = nullptr;
+        snapshot* last = nullptr;
+        for (auto s = retired_.exchange(nullptr, std::memory_order_acquire); s;)
         {
-            auto parent_color = parent->get_color();
-            auto new_parent = delete_fixup_2(parent, side);
-            if (parent_color == BLACK && p.size() > 0) // parent is black and not root
+            auto next = s->next_;
+            if (immutable_map_detail::epoch_domain::is_reclaimable(s->epoch_, epoch))
             {
-                auto grand_parent = p.get_node();
-                auto parent_side = grand_parent->get_key() > parent->get_key() ? LEFT : RIGHT;
-                auto new_grand_parent = grand_parent->clone();
-                new_grand_parent->set_child(parent_side, new_parent);
-                p.pop();
-                return delete_fixup(p, new_grand_parent, parent_side);
+                release(s, s->unborrowed_);
             }
             else
             {
-                return clone_path(p, new_parent);
+                s->next_ = kept;
+                kept = s;
+                if (!last) last = s;
             }
+            s = next;
         }
-        else
-        {
-            auto new_parent = delete_fixup_3(parent, side);
-            return clone_path(p, new_parent);
-        }
+        if (!kept) return;
+        last->next_ = retired_.load(std::memory_order_relaxed);
+        while (!retired_.compare_exchange_weak(last->next_, kept, std::memory_order_release, std::memory_order_relaxed)) {}
     }
 
-    std::shared_ptr<node> delete_fixup_1(std::shared_ptr<const node> parent, int side) const
+    allocator_type alloc_;
+    mutable std::atomic<std::uint64_t> word_;
+    std::atomic<snapshot*> retired_;
+    std::atomic<request*> pending_;
+    std::atomic<bool> combining_;
+};
+
+// a history of versions of a map under increasing sequence numbers, for
+// point-in-time reads. The oldest versions are dropped as the retention
+// policy requires, and the number of nodes each one actually freed is
+// reported: nodes still shared with retained versions, or with maps held
+// elsewhere, stay. Memory is accounted for the nodes and pair boxes of the
+// trees, each version being charged for those it does not share with the
+// version before it, and the oldest one for all of its own. That is an upper
+// bound: a version rebuilt from an older one is charged again for what it
+// shares with that older version only. Memory that keys and values allocate
+// themselves, such as the characters of a long string, is not counted. Not
+// thread-safe
+template <class Map>
+class versioned_map
+{
+public:
+    typedef Map map_type;
+    typedef typename Map::pair pair;
+    typedef typename pair::first_type key_type;
+    typedef typename pair::second_type mapped_type;
+    typedef std::uint64_t version_type;
+    typedef std::chrono::steady_clock clock;
+    typedef std::function<void(version_type version, size_t nodes_freed)> drop_callback;
+
+    // limits on the versions kept; zero means no limit. The latest version
+    // is always kept
+    struct retention
     {
-        auto parent_color = parent->get_color();
-        auto sibling = parent->get_child(1 - side);
-        auto child_1 = sibling->get_child(side);
-        if (child_1 && child_1->is_red())
-        {
-            auto new_child_1 = child_1->clone();
-            auto new_parent = parent->clone();
-            auto new_sibling = sibling->clone();
-            new_child_1->set_color(parent_color);
-            new_child_1->set_child(side, new_parent);
-            new_child_1->set_child(1 - side, new_sibling);
-            new_parent->set_color(BLACK);
-            new_parent->set_child(1 - side, child_1->get_child(side));
-            new_sibling->set_child(side, child_1->get_child(1 - side));
-            return new_child_1;
-        }
-        else
-        {
-            auto child_2 = sibling->get_child(1 - side);
-            auto new_child_2 = child_2->clone();
-            auto new_parent = parent->clone();
-            auto new_sibling = sibling->clone();
-            new_sibling->set_color(parent_color);
-            new_sibling->set_child(side, new_parent);
-            new_sibling->set_child(1 - side, new_child_2);
-            new_parent->set_color(BLACK);
-            new_parent->set_child(1 - side, sibling->get_child(side));
-            new_child_2->set_color(BLACK);
-            return new_sibling;
-        }
+        size_t max_versions;
+        clock::duration max_age;
+        size_t max_bytes;
+    };
+
+    versioned_map()
+      : versioned_map(retention{ 0, clock::duration::zero(), 0 })
+    {}
+
+    explicit versioned_map(const retention& policy, drop_callback on_drop = drop_callback())
+      : policy_(policy),
+        on_drop_(std::move(on_drop)),
+        next_version_(1),
+        bytes_(0)
+    {}
+
+    // records map as the next version, applies the retention policy and
+    // returns the number of the new version
+    version_type commit(map_type map)
+    {
+        size_t unshared = entries_.empty() ? map.size() * map_type::element_bytes() : map_type::unshared_bytes(map.root_.get(), entries_.back().map_);
+        entries_.push_back(entry{ next_version_, clock::now(), std::move(map), unshared });
+        bytes_ += unshared;
+        trim();
+        return next_version_++;
     }
 
-    std::shared_ptr<node> delete_fixup_2(std::shared_ptr<const node> parent, int side)  const // recoloring
+    // throws std::out_of_range for a version that is not retained
+    const map_type& snapshot(version_type version) const
     {
-        auto sibling = parent->get_child(1 - side);
-        auto new_sibling = sibling->clone();
-        auto new_parent = parent->clone();
-        new_sibling->set_color(RED);
-        new_parent->set_color(BLACK);
-        new_parent->set_child(1 - side, new_sibling);
-        return new_parent;
+        if (entries_.empty() || version < entries_.front().version_ || version > entries_.back().version_)
+            throw std::out_of_range("version not retained");
+        return entries_[version - entries_.front().version_].map_;
     }
 
-    std::shared_ptr<node> delete_fixup_3(std::shared_ptr<const node> parent, int side)  const // adjustment
+    const mapped_type& at(const key_type& key, version_type version) const
     {
-        auto sibling = parent->get_child(1 - side);
-        auto new_sibling = sibling->clone();
-        auto new_parent = parent->clone();
-        new_sibling->set_color(parent->get_color());
-        new_sibling->set_child(side, new_parent);
-        new_parent->set_color(RED);
-        new_parent->set_child(1 - side, sibling->get_child(side));
-        if (has_black_sibling_with_red_child(new_parent, side))
-        {
-            new_parent = delete_fixup_1(new_parent, side);
-            new_sibling->set_child(side, new_parent);
-            return new_sibling;
-        }
-        else if (has_black_sibling_with_black_children(new_parent, side))
-        {
-            new_parent = delete_fixup_2(new_parent, side);
-            new_sibling->set_child(side, new_parent);
-            return new_sibling;
-        }
-        else
-        {
-            return new_sibling;
-        }
+        return snapshot(version).at(key);
     }
 
-    bool has_black_sibling_with_red_child(std::shared_ptr<const node> parent, int side) const
+    template <class Key, class C = typename Map::key_compare, class = typename C::is_transparent>
+    const mapped_type& at(const Key& key, version_type version) const
     {
-        auto sibling = parent->get_child(1 - side);
-        if (sibling->is_red()) return false;
-        return sibling->has_red_child();
+        return snapshot(version).at(key);
     }
 
-    bool has_black_sibling_with_black_children(std::shared_ptr<const node> parent, int side) const
+    bool empty() const
     {
-        auto sibling = parent->get_child(1 - side);
-        if (sibling->is_red()) return false;
-        return !sibling->has_red_child();
+        return entries_.empty();
+    }
+
+    // the number of versions retained
+    size_t size() const
+    {
+        return entries_.size();
     }
 
-    bool has_red_sibling(std::shared_ptr<const node> parent, int side) const
+    version_type oldest() const
     {
-        auto sibling = parent->get_child(1 - side);
-        return sibling && sibling->is_red();
+        return entries_.front().version_;
+    }
+
+    version_type latest() const
+    {
+        return entries_.back().version_;
     }
+
+    size_t memory_usage() const
+    {
+        return bytes_;
+    }
+
+    // applies the retention policy; the age limit also drops versions
+    // between commits
+    void trim()
+    {
+        auto now = clock::now();
+        while (entries_.size() > 1 &&
+               ((policy_.max_versions && entries_.size() > policy_.max_versions) ||
+                (policy_.max_age != clock::duration::zero() && now - entries_.front().time_ > policy_.max_age) ||
+                (policy_.max_bytes && memory_usage() > policy_.max_bytes)))
+        {
+            drop_oldest();
+        }
+    }
+
+private:
+    struct entry
+    {
+        version_type version_;
+        clock::time_point time_;
+        map_type map_;
+        size_t unshared_bytes_;
+    };
+
+    void drop_oldest()
+    {
+        auto version = entries_.front().version_;
+        bytes_ -= entries_.front().map_.size() * map_type::element_bytes() + entries_[1].unshared_bytes_;
+        bytes_ += entries_[1].map_.size() * map_type::element_bytes();
+        reclaimer_.retire(std::move(entries_.front().map_));
+        entries_.pop_front();
+        size_t freed = reclaimer_.drain(size_t(-1));
+        if (on_drop_) on_drop_(version, freed);
+    }
+
+    retention policy_;
+    drop_callback on_drop_;
+    std::deque<entry> entries_;
+    version_type next_version_;
+    size_t bytes_;
+    typename map_type::reclaimer reclaimer_;
 };
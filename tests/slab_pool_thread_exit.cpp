@@ -0,0 +1,36 @@
+// Frees pooled blocks after the owning thread's cache has been destroyed:
+// a thread_local map built before the cache is released after it, and the
+// threads that follow must still allocate from an intact shared pool.
+// Build: g++ -std=c++17 -pthread tests/slab_pool_thread_exit.cpp && ./a.out
+
+#include <cassert>
+#include <thread>
+#include "../immutable_map.h"
+
+typedef immutable_map<int, int, std::less<int>, pool_allocator<std::pair<const int, int>>> pooled_map;
+
+static void fill(pooled_map& map, int n)
+{
+    for (int i = 0; i < n; i++)
+        map = map.insert(std::make_pair(i, i));
+}
+
+int main()
+{
+    for (int round = 0; round < 8; round++)
+    {
+        std::thread([] {
+            thread_local pooled_map map;
+            fill(map, 5000);
+        }).join();
+        std::thread([] {
+            pooled_map map;
+            fill(map, 5000);
+            for (int i = 0; i < 5000; i++)
+                assert(map.at(i) == i);
+        }).join();
+    }
+    static pooled_map global;
+    fill(global, 5000);
+    return 0;
+}